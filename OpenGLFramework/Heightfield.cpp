@@ -0,0 +1,202 @@
+///////////////////////////////////////////////////////////////////////////////
+// Heightfield.cpp
+// ===============
+// Terrain heights sampled on the planet grid.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include "Heightfield.h"
+
+
+
+// constants //////////////////////////////////////////////////////////////////
+const std::size_t ROW_ALIGNMENT = 64;                           // bytes, one cache line
+const std::size_t ROW_FLOATS = ROW_ALIGNMENT / sizeof(float);
+
+// # of floats a row of count floats takes, rounded up to whole cache lines
+static std::size_t alignRow(std::size_t count)
+{
+    return (count + ROW_FLOATS - 1) / ROW_FLOATS * ROW_FLOATS;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ctors/dtor
+///////////////////////////////////////////////////////////////////////////////
+Heightfield::Heightfield() : block(0), capacity(0), heights(0), slopes(0), rows(0), columns(0),
+                             stride(0), slopeStride(0), minHeight(0), maxHeight(0)
+{
+}
+
+// a copy of a mapped heightfield shares the mapping; owned samples are copied
+Heightfield::Heightfield(const Heightfield& other) : Heightfield()
+{
+    minHeight = other.minHeight;
+    maxHeight = other.maxHeight;
+    if(other.isMapped())
+        map(other.file, other.heights, other.slopes, other.rows, other.columns);
+    else if(!other.isEmpty())
+    {
+        resize(other.rows, other.columns, other.hasSlopes());
+        memcpy(block, other.block, (rows * (stride + slopeStride)) * sizeof(float));
+    }
+}
+
+Heightfield::Heightfield(Heightfield&& other) : Heightfield()
+{
+    swap(other);
+}
+
+Heightfield::~Heightfield()
+{
+    allocate(0);
+}
+
+Heightfield& Heightfield::operator=(Heightfield other)
+{
+    swap(other);
+    return *this;
+}
+
+void Heightfield::swap(Heightfield& other)
+{
+    std::swap(block, other.block);
+    std::swap(capacity, other.capacity);
+    std::swap(heights, other.heights);
+    std::swap(slopes, other.slopes);
+    std::swap(rows, other.rows);
+    std::swap(columns, other.columns);
+    std::swap(stride, other.stride);
+    std::swap(slopeStride, other.slopeStride);
+    std::swap(minHeight, other.minHeight);
+    std::swap(maxHeight, other.maxHeight);
+    std::swap(file, other.file);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// replace the block with an aligned one of size floats (none if 0)
+///////////////////////////////////////////////////////////////////////////////
+void Heightfield::allocate(std::size_t size)
+{
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+    block = 0;
+    capacity = 0;
+    if(size == 0)
+        return;
+
+    void* p = 0;
+#ifdef _WIN32
+    p = _aligned_malloc(size * sizeof(float), ROW_ALIGNMENT);
+#else
+    if(posix_memalign(&p, ROW_ALIGNMENT, size * sizeof(float)) != 0)
+        p = 0;
+#endif
+    if(!p)
+        throw std::bad_alloc();
+    block = (float*)p;
+    capacity = size;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// lay out rows x columns samples in the owned block, heights then slopes
+///////////////////////////////////////////////////////////////////////////////
+void Heightfield::resize(int rows, int columns, bool slopes)
+{
+    file.reset();                           // no longer viewing a cache
+
+    this->rows = rows;
+    this->columns = columns;
+    stride = alignRow(columns);
+    slopeStride = slopes ? alignRow((std::size_t)columns * 3) : 0;
+
+    std::size_t size = (std::size_t)rows * (stride + slopeStride);
+    if(size > capacity)
+        allocate(size);
+    heights = block;
+    this->slopes = slopes ? block + (std::size_t)rows * stride : 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// point at samples in a mapped cache; the owned block is freed
+///////////////////////////////////////////////////////////////////////////////
+void Heightfield::map(const std::shared_ptr<MappedFile>& file, const float* heights, const float* slopes,
+                      int rows, int columns)
+{
+    allocate(0);
+    this->file = file;
+    this->heights = const_cast<float*>(heights);    // read-only pages; never written
+    this->slopes = const_cast<float*>(slopes);
+    this->rows = rows;
+    this->columns = columns;
+    stride = columns;
+    slopeStride = slopes ? (std::size_t)columns * 3 : 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// free the samples, keeping the range
+///////////////////////////////////////////////////////////////////////////////
+void Heightfield::release()
+{
+    allocate(0);
+    file.reset();
+    heights = slopes = 0;
+    rows = columns = 0;
+    stride = slopeStride = 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// setters
+///////////////////////////////////////////////////////////////////////////////
+void Heightfield::setRange(float minHeight, float maxHeight)
+{
+    this->minHeight = minHeight;
+    this->maxHeight = maxHeight;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// bilinear interpolation of the 4 samples around (row, column)
+///////////////////////////////////////////////////////////////////////////////
+float Heightfield::sample(float row, float column) const
+{
+    if(isEmpty())
+        return 0;
+
+    row = std::min(std::max(row, 0.0f), (float)(rows - 1));
+    column = std::min(std::max(column, 0.0f), (float)(columns - 1));
+    int i = std::min((int)row, std::max(rows - 2, 0));
+    int j = std::min((int)column, std::max(columns - 2, 0));
+    float s = row - i, t = column - j;
+    int i2 = std::min(i + 1, rows - 1);
+    int j2 = std::min(j + 1, columns - 1);
+
+    const float* r1 = getRow(i);
+    const float* r2 = getRow(i2);
+    float top = r1[j] + (r1[j2] - r1[j]) * t;
+    float bottom = r2[j] + (r2[j2] - r2[j]) * t;
+    return top + (bottom - top) * s;
+}
@@ -0,0 +1,82 @@
+///////////////////////////////////////////////////////////////////////////////
+// Heightfield.h
+// =============
+// Terrain heights sampled on the planet grid, rows x columns, with an
+// optional slope (x,y,z) per sample.
+// Heights and slopes share one cache-line aligned block; every row starts on
+// a cache line, so a row of heights is stride floats after the previous one.
+// The block is kept across resamplings of the same size and freed with the
+// object. A heightfield can instead view a mapped cache file, in which case
+// rows are tightly packed and must not be written.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef GEOMETRY_Heightfield_H
+#define GEOMETRY_Heightfield_H
+
+#include <cstddef>
+#include <memory>
+
+class MappedFile;
+
+class Heightfield
+{
+public:
+    // ctor/dtor
+    Heightfield();
+    Heightfield(const Heightfield& other);
+    Heightfield(Heightfield&& other);
+    ~Heightfield();
+
+    Heightfield& operator=(Heightfield other);
+    void swap(Heightfield& other);
+
+    // rows x columns of samples to be written; the block is only reallocated
+    // if it is too small (or mapped), and the samples are left undefined
+    void resize(int rows, int columns, bool slopes);
+
+    // view samples inside a mapped file: heights row-major, then slopes if any
+    void map(const std::shared_ptr<MappedFile>& file, const float* heights, const float* slopes,
+             int rows, int columns);
+
+    // drop the samples (and the block); the height range is kept, since a
+    // mesh displaced with it may outlive them
+    void release();
+
+    // getters/setters
+    bool isEmpty() const                    { return heights == 0; }
+    bool isMapped() const                   { return file != 0; }
+    bool hasSlopes() const                  { return slopes != 0; }
+    int getRowCount() const                 { return rows; }
+    int getColumnCount() const              { return columns; }
+    std::size_t getStride() const           { return stride; }          // floats between rows
+    std::size_t getSlopeStride() const      { return slopeStride; }
+    float* getRow(int i)                    { return heights + i * stride; }
+    const float* getRow(int i) const        { return heights + i * stride; }
+    float* getSlopes(int i)                 { return slopes ? slopes + i * slopeStride : 0; }
+    const float* getSlopes(int i) const     { return slopes ? slopes + i * slopeStride : 0; }
+    float getMinHeight() const              { return minHeight; }
+    float getMaxHeight() const              { return maxHeight; }
+    float getRange() const                  { return maxHeight - minHeight; }
+    void setRange(float minHeight, float maxHeight);
+
+    // height between samples, at fractional (row, column); clamped to the edges
+    float sample(float row, float column) const;
+
+private:
+    void allocate(std::size_t size);
+
+    // member vars
+    float* block;                           // owned, 0 if none
+    std::size_t capacity;                   // # of floats in block
+    float* heights;                         // into block or the mapped file
+    float* slopes;                          // 3 floats per sample, 0 if none
+    int rows;
+    int columns;
+    std::size_t stride;
+    std::size_t slopeStride;
+    float minHeight;
+    float maxHeight;
+    std::shared_ptr<MappedFile> file;       // mapping heights point into, if any
+};
+
+#endif
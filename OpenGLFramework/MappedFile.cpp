@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+// MappedFile.cpp
+// ==============
+// Read-only memory mapping of a whole file.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "MappedFile.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ctor/dtor
+///////////////////////////////////////////////////////////////////////////////
+MappedFile::MappedFile() : data(0), size(0)
+#ifdef _WIN32
+    , file(INVALID_HANDLE_VALUE), mapping(0)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// map the whole file read-only
+// empty files cannot be mapped, so they fail like missing ones
+///////////////////////////////////////////////////////////////////////////////
+bool MappedFile::open(const char* path)
+{
+    close();
+
+#ifdef _WIN32
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER fileSize;
+    if(GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+    {
+        mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+        if(mapping)
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    size = data ? (std::size_t)fileSize.QuadPart : 0;
+#else
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void* p = mmap(0, (std::size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED)
+        {
+            data = p;
+            size = (std::size_t)info.st_size;
+        }
+    }
+    ::close(fd);                        // the mapping keeps the file alive
+#endif
+
+    if(!data)
+        close();
+    return data != 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// unmap the file; pointers into it are invalid afterwards
+///////////////////////////////////////////////////////////////////////////////
+void MappedFile::close()
+{
+#ifdef _WIN32
+    if(data)
+        UnmapViewOfFile(data);
+    if(mapping)
+        CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    mapping = 0;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if(data)
+        munmap(data, size);
+#endif
+    data = 0;
+    size = 0;
+}
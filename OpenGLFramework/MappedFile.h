@@ -0,0 +1,43 @@
+///////////////////////////////////////////////////////////////////////////////
+// MappedFile.h
+// ============
+// Read-only memory mapping of a whole file.
+// The contents are paged in by the OS on first touch instead of being read
+// up front, and stay valid until the file is closed or the object destroyed.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef GEOMETRY_MappedFile_H
+#define GEOMETRY_MappedFile_H
+
+#include <cstddef>
+
+class MappedFile
+{
+public:
+    // ctor/dtor
+    MappedFile();
+    ~MappedFile();
+
+    // map the file at path, closing any previous mapping; false on failure
+    bool open(const char* path);
+    void close();
+
+    // getters
+    bool isOpen() const                 { return data != 0; }
+    const void* getData() const         { return data; }
+    std::size_t getSize() const         { return size; }
+
+private:
+    MappedFile(const MappedFile&);      // not copyable
+    MappedFile& operator=(const MappedFile&);
+
+    // member vars
+    void* data;
+    std::size_t size;
+#ifdef _WIN32
+    void* file;                         // HANDLEs
+    void* mapping;
+#endif
+};
+
+#endif
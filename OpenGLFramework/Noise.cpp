@@ -0,0 +1,831 @@
+/* coherent noise function over 1, 2 or 3 dimensions */
+/* (copyright Ken Perlin) */
+
+#include <math.h>
+#include "Noise.h"
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define NOISE_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+#define B NoiseTables::TABLE_SIZE
+#define BM 0xff
+
+#define N 0x1000
+#define NP 12   /* 2^N */
+#define NM 0xfff
+
+#define s_curve(t) ( t * t * (3. - 2. * t) )
+
+#define lerp(t, a, b) ( a + t * (b - a) )
+
+#define setup(i,b0,b1,r0,r1)\
+	t = vec[i] + N;\
+	b0 = ((int)t) & BM;\
+	b1 = (b0+1) & BM;\
+	r0 = t - (int)t;\
+	r1 = r0 - 1.;
+
+NoiseContext::NoiseContext(uint64_t seed) : tables(std::make_shared<NoiseTables>(seed))
+{
+}
+
+double NoiseContext::noise1(double arg) const
+{
+	const int* p = tables->p;
+	const float* g1 = tables->g1;
+	int bx0, bx1;
+	float rx0, rx1, sx, t, u, v, vec[1];
+
+	vec[0] = arg;
+
+	setup(0, bx0, bx1, rx0, rx1);
+
+	sx = s_curve(rx0);
+
+	u = rx0 * g1[p[bx0]];
+	v = rx1 * g1[p[bx1]];
+
+	return lerp(sx, u, v);
+}
+
+float NoiseContext::noise2(const float vec[2]) const
+{
+	const int* p = tables->p;
+	const float (*g2)[2] = tables->g2;
+	int bx0, bx1, by0, by1, b00, b10, b01, b11;
+	float rx0, rx1, ry0, ry1, sx, sy, a, b, t, u, v;
+	const float* q;
+	int i, j;
+
+	setup(0, bx0, bx1, rx0, rx1);
+	setup(1, by0, by1, ry0, ry1);
+
+	i = p[bx0];
+	j = p[bx1];
+
+	b00 = p[i + by0];
+	b10 = p[j + by0];
+	b01 = p[i + by1];
+	b11 = p[j + by1];
+
+	sx = s_curve(rx0);
+	sy = s_curve(ry0);
+
+#define at2(rx,ry) ( rx * q[0] + ry * q[1] )
+
+	q = g2[b00]; u = at2(rx0, ry0);
+	q = g2[b10]; v = at2(rx1, ry0);
+	a = lerp(sx, u, v);
+
+	q = g2[b01]; u = at2(rx0, ry1);
+	q = g2[b11]; v = at2(rx1, ry1);
+	b = lerp(sx, u, v);
+
+	return lerp(sy, a, b);
+}
+
+float NoiseContext::noise3(const float vec[3]) const
+{
+	const int* p = tables->p;
+	const float (*g3)[3] = tables->g3;
+	int bx0, bx1, by0, by1, bz0, bz1, b00, b10, b01, b11;
+	float rx0, rx1, ry0, ry1, rz0, rz1, sy, sz, a, b, c, d, t, u, v;
+	const float* q;
+	int i, j;
+
+	setup(0, bx0, bx1, rx0, rx1);
+	setup(1, by0, by1, ry0, ry1);
+	setup(2, bz0, bz1, rz0, rz1);
+
+	i = p[bx0];
+	j = p[bx1];
+
+	b00 = p[i + by0];
+	b10 = p[j + by0];
+	b01 = p[i + by1];
+	b11 = p[j + by1];
+
+	t = s_curve(rx0);
+	sy = s_curve(ry0);
+	sz = s_curve(rz0);
+
+#define at3(rx,ry,rz) ( rx * q[0] + ry * q[1] + rz * q[2] )
+
+	q = g3[b00 + bz0]; u = at3(rx0, ry0, rz0);
+	q = g3[b10 + bz0]; v = at3(rx1, ry0, rz0);
+	a = lerp(t, u, v);
+
+	q = g3[b01 + bz0]; u = at3(rx0, ry1, rz0);
+	q = g3[b11 + bz0]; v = at3(rx1, ry1, rz0);
+	b = lerp(t, u, v);
+
+	c = lerp(sy, a, b);
+
+	q = g3[b00 + bz1]; u = at3(rx0, ry0, rz1);
+	q = g3[b10 + bz1]; v = at3(rx1, ry0, rz1);
+	a = lerp(t, u, v);
+
+	q = g3[b01 + bz1]; u = at3(rx0, ry1, rz1);
+	q = g3[b11 + bz1]; v = at3(rx1, ry1, rz1);
+	b = lerp(t, u, v);
+
+	d = lerp(sy, a, b);
+
+	return lerp(sz, c, d);
+}
+
+float NoiseContext::noise3(const float vec[3], float grad[3]) const
+{
+	const int* p = tables->p;
+	const float (*g3)[3] = tables->g3;
+	int bx0, bx1, by0, by1, bz0, bz1, b00, b10, b01, b11;
+	float rx0, rx1, ry0, ry1, rz0, rz1, sx, sy, sz, dsx, dsy, dsz, a, b, c, d, e, f, t;
+	const float* q, * gq[8];
+	float v[8];
+	int i, j, k;
+
+	setup(0, bx0, bx1, rx0, rx1);
+	setup(1, by0, by1, ry0, ry1);
+	setup(2, bz0, bz1, rz0, rz1);
+
+	i = p[bx0];
+	j = p[bx1];
+
+	b00 = p[i + by0];
+	b10 = p[j + by0];
+	b01 = p[i + by1];
+	b11 = p[j + by1];
+
+	sx = s_curve(rx0);
+	sy = s_curve(ry0);
+	sz = s_curve(rz0);
+
+	/* derivative of the s_curve, 6t(1 - t) */
+	dsx = 6 * rx0 * (1 - rx0);
+	dsy = 6 * ry0 * (1 - ry0);
+	dsz = 6 * rz0 * (1 - rz0);
+
+	q = gq[0] = g3[b00 + bz0]; v[0] = at3(rx0, ry0, rz0);
+	q = gq[1] = g3[b10 + bz0]; v[1] = at3(rx1, ry0, rz0);
+	q = gq[2] = g3[b01 + bz0]; v[2] = at3(rx0, ry1, rz0);
+	q = gq[3] = g3[b11 + bz0]; v[3] = at3(rx1, ry1, rz0);
+	q = gq[4] = g3[b00 + bz1]; v[4] = at3(rx0, ry0, rz1);
+	q = gq[5] = g3[b10 + bz1]; v[5] = at3(rx1, ry0, rz1);
+	q = gq[6] = g3[b01 + bz1]; v[6] = at3(rx0, ry1, rz1);
+	q = gq[7] = g3[b11 + bz1]; v[7] = at3(rx1, ry1, rz1);
+
+	a = lerp(sx, v[0], v[1]);
+	b = lerp(sx, v[2], v[3]);
+	e = lerp(sx, v[4], v[5]);
+	f = lerp(sx, v[6], v[7]);
+	c = lerp(sy, a, b);
+	d = lerp(sy, e, f);
+
+	/* each corner's value changes along its gradient: blend the gradients with the same weights */
+	for (k = 0; k < 3; k++)
+		grad[k] = lerp(sz, lerp(sy, lerp(sx, gq[0][k], gq[1][k]), lerp(sx, gq[2][k], gq[3][k])),
+		                   lerp(sy, lerp(sx, gq[4][k], gq[5][k]), lerp(sx, gq[6][k], gq[7][k])));
+
+	/* ... plus the change of the weights themselves */
+	float e0 = v[1] - v[0], e1 = v[3] - v[2], e2 = v[5] - v[4], e3 = v[7] - v[6];
+	float ab = b - a, ef = f - e;
+	grad[0] += dsx * lerp(sz, lerp(sy, e0, e1), lerp(sy, e2, e3));
+	grad[1] += dsy * lerp(sz, ab, ef);
+	grad[2] += dsz * (d - c);
+
+	return lerp(sz, c, d);
+}
+
+#ifdef NOISE_SIMD
+/*
+ * Batched noise3. Both kernels follow the scalar code above step for step:
+ * the lattice setup, the s_curve weights and the trilinear lerps are done
+ * on 4 or 8 lanes at once, so results agree with noise3() to float rounding.
+ */
+TARGET_SSE41 static void noise3x4(const int* p, const float* g, const float* x, const float* y, const float* z, float* out)
+{
+	const __m128 n = _mm_set1_ps((float)N);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 three = _mm_set1_ps(3.0f);
+	const __m128i bm = _mm_set1_epi32(BM);
+	const __m128i ione = _mm_set1_epi32(1);
+
+	__m128 tx = _mm_add_ps(_mm_loadu_ps(x), n);
+	__m128 ty = _mm_add_ps(_mm_loadu_ps(y), n);
+	__m128 tz = _mm_add_ps(_mm_loadu_ps(z), n);
+	__m128i ix = _mm_cvttps_epi32(tx);
+	__m128i iy = _mm_cvttps_epi32(ty);
+	__m128i iz = _mm_cvttps_epi32(tz);
+
+	int bx0[4], bx1[4], by0[4], by1[4], bz0[4], bz1[4];
+	_mm_storeu_si128((__m128i*)bx0, _mm_and_si128(ix, bm));
+	_mm_storeu_si128((__m128i*)bx1, _mm_and_si128(_mm_add_epi32(ix, ione), bm));
+	_mm_storeu_si128((__m128i*)by0, _mm_and_si128(iy, bm));
+	_mm_storeu_si128((__m128i*)by1, _mm_and_si128(_mm_add_epi32(iy, ione), bm));
+	_mm_storeu_si128((__m128i*)bz0, _mm_and_si128(iz, bm));
+	_mm_storeu_si128((__m128i*)bz1, _mm_and_si128(_mm_add_epi32(iz, ione), bm));
+
+	__m128 rx0 = _mm_sub_ps(tx, _mm_cvtepi32_ps(ix)), rx1 = _mm_sub_ps(rx0, one);
+	__m128 ry0 = _mm_sub_ps(ty, _mm_cvtepi32_ps(iy)), ry1 = _mm_sub_ps(ry0, one);
+	__m128 rz0 = _mm_sub_ps(tz, _mm_cvtepi32_ps(iz)), rz1 = _mm_sub_ps(rz0, one);
+
+	// no gather before AVX2: fetch the 8 corner gradients lane by lane
+	float gx[8][4], gy[8][4], gz[8][4];
+	for (int l = 0; l < 4; l++) {
+		int i = p[bx0[l]];
+		int j = p[bx1[l]];
+		int c[8] = {
+			p[i + by0[l]] + bz0[l], p[j + by0[l]] + bz0[l], p[i + by1[l]] + bz0[l], p[j + by1[l]] + bz0[l],
+			p[i + by0[l]] + bz1[l], p[j + by0[l]] + bz1[l], p[i + by1[l]] + bz1[l], p[j + by1[l]] + bz1[l]
+		};
+		for (int k = 0; k < 8; k++) {
+			gx[k][l] = g[c[k] * 3];
+			gy[k][l] = g[c[k] * 3 + 1];
+			gz[k][l] = g[c[k] * 3 + 2];
+		}
+	}
+
+#define dot4(k,rx,ry,rz) _mm_add_ps(_mm_add_ps(_mm_mul_ps(rx, _mm_loadu_ps(gx[k])), _mm_mul_ps(ry, _mm_loadu_ps(gy[k]))), _mm_mul_ps(rz, _mm_loadu_ps(gz[k])))
+#define lerp4(t,a,b) _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)))
+#define s_curve4(t) _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(three, _mm_mul_ps(two, t)))
+
+	__m128 sx = s_curve4(rx0), sy = s_curve4(ry0), sz = s_curve4(rz0);
+	__m128 a, b, c, d;
+
+	a = lerp4(sx, dot4(0, rx0, ry0, rz0), dot4(1, rx1, ry0, rz0));
+	b = lerp4(sx, dot4(2, rx0, ry1, rz0), dot4(3, rx1, ry1, rz0));
+	c = lerp4(sy, a, b);
+
+	a = lerp4(sx, dot4(4, rx0, ry0, rz1), dot4(5, rx1, ry0, rz1));
+	b = lerp4(sx, dot4(6, rx0, ry1, rz1), dot4(7, rx1, ry1, rz1));
+	d = lerp4(sy, a, b);
+
+	_mm_storeu_ps(out, lerp4(sz, c, d));
+}
+
+/* gather the gradients at table offsets q and dot them with (rx, ry, rz) */
+TARGET_AVX2 static __m256 gradDot8(const float* g, __m256i q, __m256 rx, __m256 ry, __m256 rz)
+{
+	__m256 r = _mm256_mul_ps(rx, _mm256_i32gather_ps(g, q, 4));
+	r = _mm256_fmadd_ps(ry, _mm256_i32gather_ps(g + 1, q, 4), r);
+	return _mm256_fmadd_ps(rz, _mm256_i32gather_ps(g + 2, q, 4), r);
+}
+
+TARGET_AVX2 static void noise3x8(const int* p, const float* g, const float* x, const float* y, const float* z, float* out)
+{
+	const __m256 n = _mm256_set1_ps((float)N);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 two = _mm256_set1_ps(2.0f);
+	const __m256 three = _mm256_set1_ps(3.0f);
+	const __m256i bm = _mm256_set1_epi32(BM);
+	const __m256i ione = _mm256_set1_epi32(1);
+
+	__m256 tx = _mm256_add_ps(_mm256_loadu_ps(x), n);
+	__m256 ty = _mm256_add_ps(_mm256_loadu_ps(y), n);
+	__m256 tz = _mm256_add_ps(_mm256_loadu_ps(z), n);
+	__m256i ix = _mm256_cvttps_epi32(tx);
+	__m256i iy = _mm256_cvttps_epi32(ty);
+	__m256i iz = _mm256_cvttps_epi32(tz);
+
+	__m256i bx0 = _mm256_and_si256(ix, bm), bx1 = _mm256_and_si256(_mm256_add_epi32(ix, ione), bm);
+	__m256i by0 = _mm256_and_si256(iy, bm), by1 = _mm256_and_si256(_mm256_add_epi32(iy, ione), bm);
+	__m256i bz0 = _mm256_and_si256(iz, bm), bz1 = _mm256_and_si256(_mm256_add_epi32(iz, ione), bm);
+
+	__m256 rx0 = _mm256_sub_ps(tx, _mm256_cvtepi32_ps(ix)), rx1 = _mm256_sub_ps(rx0, one);
+	__m256 ry0 = _mm256_sub_ps(ty, _mm256_cvtepi32_ps(iy)), ry1 = _mm256_sub_ps(ry0, one);
+	__m256 rz0 = _mm256_sub_ps(tz, _mm256_cvtepi32_ps(iz)), rz1 = _mm256_sub_ps(rz0, one);
+
+	__m256i i = _mm256_i32gather_epi32(p, bx0, 4);
+	__m256i j = _mm256_i32gather_epi32(p, bx1, 4);
+	__m256i b00 = _mm256_i32gather_epi32(p, _mm256_add_epi32(i, by0), 4);
+	__m256i b10 = _mm256_i32gather_epi32(p, _mm256_add_epi32(j, by0), 4);
+	__m256i b01 = _mm256_i32gather_epi32(p, _mm256_add_epi32(i, by1), 4);
+	__m256i b11 = _mm256_i32gather_epi32(p, _mm256_add_epi32(j, by1), 4);
+
+#define dot8(b,bz,rx,ry,rz) gradDot8(g, _mm256_mullo_epi32(_mm256_add_epi32(b, bz), _mm256_set1_epi32(3)), rx, ry, rz)
+#define lerp8(t,a,b) _mm256_fmadd_ps(t, _mm256_sub_ps(b, a), a)
+#define s_curve8(t) _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(three, _mm256_mul_ps(two, t)))
+
+	__m256 sx = s_curve8(rx0), sy = s_curve8(ry0), sz = s_curve8(rz0);
+	__m256 a, b, c, d;
+
+	a = lerp8(sx, dot8(b00, bz0, rx0, ry0, rz0), dot8(b10, bz0, rx1, ry0, rz0));
+	b = lerp8(sx, dot8(b01, bz0, rx0, ry1, rz0), dot8(b11, bz0, rx1, ry1, rz0));
+	c = lerp8(sy, a, b);
+
+	a = lerp8(sx, dot8(b00, bz1, rx0, ry0, rz1), dot8(b10, bz1, rx1, ry0, rz1));
+	b = lerp8(sx, dot8(b01, bz1, rx0, ry1, rz1), dot8(b11, bz1, rx1, ry1, rz1));
+	d = lerp8(sy, a, b);
+
+	_mm256_storeu_ps(out, lerp8(sz, c, d));
+}
+
+TARGET_AVX2 static void noise3x8grad(const int* p, const float* g, const float* x, const float* y, const float* z,
+	float* out, float* dx, float* dy, float* dz)
+{
+	const __m256 n = _mm256_set1_ps((float)N);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 two = _mm256_set1_ps(2.0f);
+	const __m256 three = _mm256_set1_ps(3.0f);
+	const __m256 six = _mm256_set1_ps(6.0f);
+	const __m256i bm = _mm256_set1_epi32(BM);
+	const __m256i ione = _mm256_set1_epi32(1);
+	const __m256i ithree = _mm256_set1_epi32(3);
+
+	__m256 tx = _mm256_add_ps(_mm256_loadu_ps(x), n);
+	__m256 ty = _mm256_add_ps(_mm256_loadu_ps(y), n);
+	__m256 tz = _mm256_add_ps(_mm256_loadu_ps(z), n);
+	__m256i ix = _mm256_cvttps_epi32(tx);
+	__m256i iy = _mm256_cvttps_epi32(ty);
+	__m256i iz = _mm256_cvttps_epi32(tz);
+
+	__m256i bx0 = _mm256_and_si256(ix, bm), bx1 = _mm256_and_si256(_mm256_add_epi32(ix, ione), bm);
+	__m256i by0 = _mm256_and_si256(iy, bm), by1 = _mm256_and_si256(_mm256_add_epi32(iy, ione), bm);
+	__m256i bz0 = _mm256_and_si256(iz, bm), bz1 = _mm256_and_si256(_mm256_add_epi32(iz, ione), bm);
+
+	__m256 rx0 = _mm256_sub_ps(tx, _mm256_cvtepi32_ps(ix)), rx1 = _mm256_sub_ps(rx0, one);
+	__m256 ry0 = _mm256_sub_ps(ty, _mm256_cvtepi32_ps(iy)), ry1 = _mm256_sub_ps(ry0, one);
+	__m256 rz0 = _mm256_sub_ps(tz, _mm256_cvtepi32_ps(iz)), rz1 = _mm256_sub_ps(rz0, one);
+
+	__m256i i = _mm256_i32gather_epi32(p, bx0, 4);
+	__m256i j = _mm256_i32gather_epi32(p, bx1, 4);
+	__m256i b00 = _mm256_i32gather_epi32(p, _mm256_add_epi32(i, by0), 4);
+	__m256i b10 = _mm256_i32gather_epi32(p, _mm256_add_epi32(j, by0), 4);
+	__m256i b01 = _mm256_i32gather_epi32(p, _mm256_add_epi32(i, by1), 4);
+	__m256i b11 = _mm256_i32gather_epi32(p, _mm256_add_epi32(j, by1), 4);
+
+	/* corners in the order of the scalar code: x fastest, then y, then z */
+	__m256i corner[8] = {
+		_mm256_add_epi32(b00, bz0), _mm256_add_epi32(b10, bz0), _mm256_add_epi32(b01, bz0), _mm256_add_epi32(b11, bz0),
+		_mm256_add_epi32(b00, bz1), _mm256_add_epi32(b10, bz1), _mm256_add_epi32(b01, bz1), _mm256_add_epi32(b11, bz1)
+	};
+	__m256 qx[8], qy[8], qz[8], v[8];
+	for (int c = 0; c < 8; c++) {
+		__m256i q = _mm256_mullo_epi32(corner[c], ithree);
+		__m256 rx = (c & 1) ? rx1 : rx0;
+		__m256 ry = (c & 2) ? ry1 : ry0;
+		__m256 rz = (c & 4) ? rz1 : rz0;
+		qx[c] = _mm256_i32gather_ps(g, q, 4);
+		qy[c] = _mm256_i32gather_ps(g + 1, q, 4);
+		qz[c] = _mm256_i32gather_ps(g + 2, q, 4);
+		v[c] = _mm256_fmadd_ps(rz, qz[c], _mm256_fmadd_ps(ry, qy[c], _mm256_mul_ps(rx, qx[c])));
+	}
+
+	__m256 sx = s_curve8(rx0), sy = s_curve8(ry0), sz = s_curve8(rz0);
+	__m256 dsx = _mm256_mul_ps(_mm256_mul_ps(six, rx0), _mm256_sub_ps(one, rx0));
+	__m256 dsy = _mm256_mul_ps(_mm256_mul_ps(six, ry0), _mm256_sub_ps(one, ry0));
+	__m256 dsz = _mm256_mul_ps(_mm256_mul_ps(six, rz0), _mm256_sub_ps(one, rz0));
+
+	__m256 a = lerp8(sx, v[0], v[1]);
+	__m256 b = lerp8(sx, v[2], v[3]);
+	__m256 e = lerp8(sx, v[4], v[5]);
+	__m256 f = lerp8(sx, v[6], v[7]);
+	__m256 c = lerp8(sy, a, b);
+	__m256 d = lerp8(sy, e, f);
+
+#define trilerp8(q) lerp8(sz, lerp8(sy, lerp8(sx, q[0], q[1]), lerp8(sx, q[2], q[3])), \
+                          lerp8(sy, lerp8(sx, q[4], q[5]), lerp8(sx, q[6], q[7])))
+
+	__m256 ddx = lerp8(sz, lerp8(sy, _mm256_sub_ps(v[1], v[0]), _mm256_sub_ps(v[3], v[2])),
+	                       lerp8(sy, _mm256_sub_ps(v[5], v[4]), _mm256_sub_ps(v[7], v[6])));
+	__m256 ddy = lerp8(sz, _mm256_sub_ps(b, a), _mm256_sub_ps(f, e));
+	__m256 ddz = _mm256_sub_ps(d, c);
+
+	_mm256_storeu_ps(out, lerp8(sz, c, d));
+	_mm256_storeu_ps(dx, _mm256_fmadd_ps(dsx, ddx, trilerp8(qx)));
+	_mm256_storeu_ps(dy, _mm256_fmadd_ps(dsy, ddy, trilerp8(qy)));
+	_mm256_storeu_ps(dz, _mm256_fmadd_ps(dsz, ddz, trilerp8(qz)));
+}
+
+static int detectBatchWidth()
+{
+#ifdef _MSC_VER
+	int r[4];
+	__cpuid(r, 0);
+	int maxLeaf = r[0];
+	__cpuid(r, 1);
+	bool sse41 = (r[2] & (1 << 19)) != 0;
+	bool fma = (r[2] & (1 << 12)) != 0;
+	bool avx = (r[2] & (1 << 28)) != 0 && (r[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+	bool avx2 = false;
+	if (maxLeaf >= 7) {
+		__cpuidex(r, 7, 0);
+		avx2 = (r[1] & (1 << 5)) != 0;
+	}
+	if (avx && avx2 && fma) return 8;
+	return sse41 ? 4 : 1;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return 8;
+	return __builtin_cpu_supports("sse4.1") ? 4 : 1;
+#endif
+}
+#endif
+
+int NoiseContext::batchWidth()
+{
+#ifdef NOISE_SIMD
+	static const int width = detectBatchWidth();
+	return width;
+#else
+	return 1;
+#endif
+}
+
+void NoiseContext::noise3(const float* x, const float* y, const float* z, float* out, int count) const
+{
+	const int* p = tables->p;
+	const float (*g3)[3] = tables->g3;
+	int i = 0;
+#ifdef NOISE_SIMD
+	int width = batchWidth();
+	if (width == 8) {
+		for (; i + 8 <= count; i += 8)
+			noise3x8(p, &g3[0][0], x + i, y + i, z + i, out + i);
+	}
+	if (width >= 4) {
+		for (; i + 4 <= count; i += 4)
+			noise3x4(p, &g3[0][0], x + i, y + i, z + i, out + i);
+	}
+#endif
+	for (; i < count; i++) {
+		float vec[3] = { x[i], y[i], z[i] };
+		out[i] = NoiseContext::noise3(vec);
+	}
+}
+
+void NoiseContext::noise3(const float* x, const float* y, const float* z, float* out,
+                          float* dx, float* dy, float* dz, int count) const
+{
+	const int* p = tables->p;
+	const float (*g3)[3] = tables->g3;
+	int i = 0;
+#ifdef NOISE_SIMD
+	if (batchWidth() == 8) {
+		for (; i + 8 <= count; i += 8)
+			noise3x8grad(p, &g3[0][0], x + i, y + i, z + i, out + i, dx + i, dy + i, dz + i);
+	}
+#endif
+	for (; i < count; i++) {
+		float vec[3] = { x[i], y[i], z[i] };
+		float grad[3];
+		out[i] = NoiseContext::noise3(vec, grad);
+		dx[i] = grad[0];
+		dy[i] = grad[1];
+		dz[i] = grad[2];
+	}
+}
+
+#define SIMPLEX_SCALE 50.0f  /* brings simplex to about the spread of noise3 */
+#define SIMPLEX_RADIUS 0.5f  /* squared corner falloff radius; 0.5 keeps it continuous across simplex faces */
+
+static inline int fastfloor(float x)
+{
+	int i = (int)x;
+	return x < i ? i - 1 : i;
+}
+
+SimplexNoise::SimplexNoise(uint64_t seed) : tables(std::make_shared<NoiseTables>(seed))
+{
+}
+
+/*
+ * find the simplex holding vec: the offsets (x, y, z) of vec from each of its
+ * 4 corners and the gradient table index c of each corner
+ */
+void SimplexNoise::corners(const float vec[3], float x[4], float y[4], float z[4], int c[4]) const
+{
+	const int* p = tables->p;
+	const float F3 = 1.0f / 3.0f;
+	const float G3 = 1.0f / 6.0f;
+	int i1, j1, k1, i2, j2, k2;
+
+	/* skew into the simplex lattice to find the cell, then unskew back */
+	float s = (vec[0] + vec[1] + vec[2]) * F3;
+	int i = fastfloor(vec[0] + s);
+	int j = fastfloor(vec[1] + s);
+	int k = fastfloor(vec[2] + s);
+	float t = (i + j + k) * G3;
+
+	x[0] = vec[0] - (i - t);
+	y[0] = vec[1] - (j - t);
+	z[0] = vec[2] - (k - t);
+
+	/* rank the offsets to pick which of the 6 tetrahedra we are in */
+	if (x[0] >= y[0]) {
+		if (y[0] >= z[0])      { i1 = 1; j1 = 0; k1 = 0; i2 = 1; j2 = 1; k2 = 0; }
+		else if (x[0] >= z[0]) { i1 = 1; j1 = 0; k1 = 0; i2 = 1; j2 = 0; k2 = 1; }
+		else                   { i1 = 0; j1 = 0; k1 = 1; i2 = 1; j2 = 0; k2 = 1; }
+	}
+	else {
+		if (y[0] < z[0])       { i1 = 0; j1 = 0; k1 = 1; i2 = 0; j2 = 1; k2 = 1; }
+		else if (x[0] < z[0])  { i1 = 0; j1 = 1; k1 = 0; i2 = 0; j2 = 1; k2 = 1; }
+		else                   { i1 = 0; j1 = 1; k1 = 0; i2 = 1; j2 = 1; k2 = 0; }
+	}
+
+	x[1] = x[0] - i1 + G3;       y[1] = y[0] - j1 + G3;       z[1] = z[0] - k1 + G3;
+	x[2] = x[0] - i2 + 2 * G3;   y[2] = y[0] - j2 + 2 * G3;   z[2] = z[0] - k2 + 2 * G3;
+	x[3] = x[0] - 1 + 3 * G3;    y[3] = y[0] - 1 + 3 * G3;    z[3] = z[0] - 1 + 3 * G3;
+
+	int ii = i & BM, jj = j & BM, kk = k & BM;
+	c[0] = p[ii + p[jj + p[kk]]];
+	c[1] = p[ii + i1 + p[jj + j1 + p[kk + k1]]];
+	c[2] = p[ii + i2 + p[jj + j2 + p[kk + k2]]];
+	c[3] = p[ii + 1 + p[jj + 1 + p[kk + 1]]];
+}
+
+float SimplexNoise::noise3(const float vec[3]) const
+{
+	const float (*g3)[3] = tables->g3;
+	float x[4], y[4], z[4];
+	int c[4];
+
+	corners(vec, x, y, z, c);
+
+	float n = 0;
+	for (int corner = 0; corner < 4; corner++) {
+		float w = SIMPLEX_RADIUS - x[corner] * x[corner] - y[corner] * y[corner] - z[corner] * z[corner];
+		if (w > 0) {
+			const float* q = g3[c[corner]];
+			w *= w;
+			n += w * w * (x[corner] * q[0] + y[corner] * q[1] + z[corner] * q[2]);
+		}
+	}
+
+	return SIMPLEX_SCALE * n;
+}
+
+float SimplexNoise::noise3(const float vec[3], float grad[3]) const
+{
+	const float (*g3)[3] = tables->g3;
+	float x[4], y[4], z[4];
+	int c[4];
+
+	corners(vec, x, y, z, c);
+
+	/* d/dr of w^4 (g . r) with w = SIMPLEX_RADIUS - r.r is -8 w^3 (g . r) r + w^4 g */
+	float n = 0;
+	grad[0] = grad[1] = grad[2] = 0;
+	for (int corner = 0; corner < 4; corner++) {
+		float w = SIMPLEX_RADIUS - x[corner] * x[corner] - y[corner] * y[corner] - z[corner] * z[corner];
+		if (w > 0) {
+			const float* q = g3[c[corner]];
+			float d = x[corner] * q[0] + y[corner] * q[1] + z[corner] * q[2];
+			float w2 = w * w;
+			float w4 = w2 * w2;
+			float k = -8 * w2 * w * d;
+			n += w4 * d;
+			grad[0] += k * x[corner] + w4 * q[0];
+			grad[1] += k * y[corner] + w4 * q[1];
+			grad[2] += k * z[corner] + w4 * q[2];
+		}
+	}
+
+	grad[0] *= SIMPLEX_SCALE;
+	grad[1] *= SIMPLEX_SCALE;
+	grad[2] *= SIMPLEX_SCALE;
+	return SIMPLEX_SCALE * n;
+}
+
+#ifdef NOISE_SIMD
+/* 8 lanes of SimplexNoise::corners(); the tetrahedron ranking becomes compare masks */
+struct Simplex8
+{
+	__m256 x[4], y[4], z[4];
+	__m256i q[4];       // gradient table offsets (index * 3) of the corners
+};
+
+TARGET_AVX2 static __m256i simplexHash8(const int* p, __m256i ii, __m256i jj, __m256i kk, __m256i di, __m256i dj, __m256i dk)
+{
+	__m256i h = _mm256_i32gather_epi32(p, _mm256_add_epi32(kk, dk), 4);
+	h = _mm256_i32gather_epi32(p, _mm256_add_epi32(_mm256_add_epi32(jj, dj), h), 4);
+	h = _mm256_i32gather_epi32(p, _mm256_add_epi32(_mm256_add_epi32(ii, di), h), 4);
+	return _mm256_mullo_epi32(h, _mm256_set1_epi32(3));
+}
+
+TARGET_AVX2 static void simplexCorners8(const int* p, const float* px, const float* py, const float* pz, Simplex8& s)
+{
+	const __m256 f3 = _mm256_set1_ps(1.0f / 3.0f);
+	const __m256 g3 = _mm256_set1_ps(1.0f / 6.0f);
+	const __m256 g3x2 = _mm256_set1_ps(2 * (1.0f / 6.0f));
+	const __m256 g3x3 = _mm256_set1_ps(3 * (1.0f / 6.0f));
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256i bm = _mm256_set1_epi32(BM);
+	const __m256i ione = _mm256_set1_epi32(1);
+	const __m256i zero = _mm256_setzero_si256();
+
+	__m256 x = _mm256_loadu_ps(px), y = _mm256_loadu_ps(py), z = _mm256_loadu_ps(pz);
+	__m256 skew = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(x, y), z), f3);
+	__m256 fi = _mm256_floor_ps(_mm256_add_ps(x, skew));
+	__m256 fj = _mm256_floor_ps(_mm256_add_ps(y, skew));
+	__m256 fk = _mm256_floor_ps(_mm256_add_ps(z, skew));
+	__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(fi, fj), fk), g3);
+
+	__m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(fi, t));
+	__m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(fj, t));
+	__m256 z0 = _mm256_sub_ps(z, _mm256_sub_ps(fk, t));
+
+	__m256i xy = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(x0, y0, _CMP_GE_OQ)), ione);
+	__m256i yz = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(y0, z0, _CMP_GE_OQ)), ione);
+	__m256i xz = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(x0, z0, _CMP_GE_OQ)), ione);
+	__m256i i1 = _mm256_and_si256(xy, xz);
+	__m256i j1 = _mm256_andnot_si256(xy, yz);
+	__m256i k1 = _mm256_andnot_si256(xz, _mm256_andnot_si256(yz, ione));
+	__m256i i2 = _mm256_or_si256(xy, xz);
+	__m256i j2 = _mm256_or_si256(_mm256_andnot_si256(xy, ione), yz);
+	__m256i k2 = _mm256_andnot_si256(_mm256_and_si256(xz, yz), ione);
+
+	s.x[0] = x0;
+	s.y[0] = y0;
+	s.z[0] = z0;
+	s.x[1] = _mm256_add_ps(_mm256_sub_ps(x0, _mm256_cvtepi32_ps(i1)), g3);
+	s.y[1] = _mm256_add_ps(_mm256_sub_ps(y0, _mm256_cvtepi32_ps(j1)), g3);
+	s.z[1] = _mm256_add_ps(_mm256_sub_ps(z0, _mm256_cvtepi32_ps(k1)), g3);
+	s.x[2] = _mm256_add_ps(_mm256_sub_ps(x0, _mm256_cvtepi32_ps(i2)), g3x2);
+	s.y[2] = _mm256_add_ps(_mm256_sub_ps(y0, _mm256_cvtepi32_ps(j2)), g3x2);
+	s.z[2] = _mm256_add_ps(_mm256_sub_ps(z0, _mm256_cvtepi32_ps(k2)), g3x2);
+	s.x[3] = _mm256_add_ps(_mm256_sub_ps(x0, one), g3x3);
+	s.y[3] = _mm256_add_ps(_mm256_sub_ps(y0, one), g3x3);
+	s.z[3] = _mm256_add_ps(_mm256_sub_ps(z0, one), g3x3);
+
+	__m256i ii = _mm256_and_si256(_mm256_cvtps_epi32(fi), bm);
+	__m256i jj = _mm256_and_si256(_mm256_cvtps_epi32(fj), bm);
+	__m256i kk = _mm256_and_si256(_mm256_cvtps_epi32(fk), bm);
+	s.q[0] = simplexHash8(p, ii, jj, kk, zero, zero, zero);
+	s.q[1] = simplexHash8(p, ii, jj, kk, i1, j1, k1);
+	s.q[2] = simplexHash8(p, ii, jj, kk, i2, j2, k2);
+	s.q[3] = simplexHash8(p, ii, jj, kk, ione, ione, ione);
+}
+
+/* radial falloff SIMPLEX_RADIUS - r.r of each corner, clamped at 0 */
+TARGET_AVX2 static __m256 simplexFalloff8(__m256 x, __m256 y, __m256 z)
+{
+	__m256 w = _mm256_sub_ps(_mm256_set1_ps(SIMPLEX_RADIUS), _mm256_mul_ps(x, x));
+	w = _mm256_fnmadd_ps(y, y, w);
+	w = _mm256_fnmadd_ps(z, z, w);
+	return _mm256_max_ps(w, _mm256_setzero_ps());
+}
+
+TARGET_AVX2 static void simplex3x8(const int* p, const float* g, const float* px, const float* py, const float* pz, float* out)
+{
+	Simplex8 s;
+	simplexCorners8(p, px, py, pz, s);
+
+	__m256 n = _mm256_setzero_ps();
+	for (int corner = 0; corner < 4; corner++) {
+		__m256 w = simplexFalloff8(s.x[corner], s.y[corner], s.z[corner]);
+		w = _mm256_mul_ps(w, w);
+		w = _mm256_mul_ps(w, w);
+		n = _mm256_fmadd_ps(w, gradDot8(g, s.q[corner], s.x[corner], s.y[corner], s.z[corner]), n);
+	}
+
+	_mm256_storeu_ps(out, _mm256_mul_ps(n, _mm256_set1_ps(SIMPLEX_SCALE)));
+}
+
+TARGET_AVX2 static void simplex3x8grad(const int* p, const float* g, const float* px, const float* py, const float* pz,
+	float* out, float* dx, float* dy, float* dz)
+{
+	Simplex8 s;
+	simplexCorners8(p, px, py, pz, s);
+
+	__m256 n = _mm256_setzero_ps();
+	__m256 gx = _mm256_setzero_ps(), gy = _mm256_setzero_ps(), gz = _mm256_setzero_ps();
+	for (int corner = 0; corner < 4; corner++) {
+		__m256 qx = _mm256_i32gather_ps(g, s.q[corner], 4);
+		__m256 qy = _mm256_i32gather_ps(g + 1, s.q[corner], 4);
+		__m256 qz = _mm256_i32gather_ps(g + 2, s.q[corner], 4);
+		__m256 d = _mm256_mul_ps(s.x[corner], qx);
+		d = _mm256_fmadd_ps(s.y[corner], qy, d);
+		d = _mm256_fmadd_ps(s.z[corner], qz, d);
+
+		__m256 w = simplexFalloff8(s.x[corner], s.y[corner], s.z[corner]);
+		__m256 w2 = _mm256_mul_ps(w, w);
+		__m256 w4 = _mm256_mul_ps(w2, w2);
+		__m256 k = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(-8.0f), _mm256_mul_ps(w2, w)), d);
+
+		n = _mm256_fmadd_ps(w4, d, n);
+		gx = _mm256_fmadd_ps(k, s.x[corner], _mm256_fmadd_ps(w4, qx, gx));
+		gy = _mm256_fmadd_ps(k, s.y[corner], _mm256_fmadd_ps(w4, qy, gy));
+		gz = _mm256_fmadd_ps(k, s.z[corner], _mm256_fmadd_ps(w4, qz, gz));
+	}
+
+	__m256 scale = _mm256_set1_ps(SIMPLEX_SCALE);
+	_mm256_storeu_ps(out, _mm256_mul_ps(n, scale));
+	_mm256_storeu_ps(dx, _mm256_mul_ps(gx, scale));
+	_mm256_storeu_ps(dy, _mm256_mul_ps(gy, scale));
+	_mm256_storeu_ps(dz, _mm256_mul_ps(gz, scale));
+}
+#endif
+
+void SimplexNoise::noise3(const float* x, const float* y, const float* z, float* out, int count) const
+{
+	const int* p = tables->p;
+	const float (*g3)[3] = tables->g3;
+	int i = 0;
+#ifdef NOISE_SIMD
+	if (NoiseContext::batchWidth() == 8) {
+		for (; i + 8 <= count; i += 8)
+			simplex3x8(p, &g3[0][0], x + i, y + i, z + i, out + i);
+	}
+#endif
+	for (; i < count; i++) {
+		float vec[3] = { x[i], y[i], z[i] };
+		out[i] = SimplexNoise::noise3(vec);
+	}
+}
+
+void SimplexNoise::noise3(const float* x, const float* y, const float* z, float* out,
+                          float* dx, float* dy, float* dz, int count) const
+{
+	const int* p = tables->p;
+	const float (*g3)[3] = tables->g3;
+	int i = 0;
+#ifdef NOISE_SIMD
+	if (NoiseContext::batchWidth() == 8) {
+		for (; i + 8 <= count; i += 8)
+			simplex3x8grad(p, &g3[0][0], x + i, y + i, z + i, out + i, dx + i, dy + i, dz + i);
+	}
+#endif
+	for (; i < count; i++) {
+		float vec[3] = { x[i], y[i], z[i] };
+		float grad[3];
+		out[i] = SimplexNoise::noise3(vec, grad);
+		dx[i] = grad[0];
+		dy[i] = grad[1];
+		dz[i] = grad[2];
+	}
+}
+
+static void normalize2(float v[2])
+{
+	float s;
+
+	s = sqrt(v[0] * v[0] + v[1] * v[1]);
+	v[0] = v[0] / s;
+	v[1] = v[1] / s;
+}
+
+static void normalize3(float v[3])
+{
+	float s;
+
+	s = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	v[0] = v[0] / s;
+	v[1] = v[1] / s;
+	v[2] = v[2] / s;
+}
+
+/* splitmix64: small, fast and identical on every compiler, unlike rand() */
+static uint64_t next(uint64_t& state)
+{
+	uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+NoiseTables::NoiseTables(uint64_t seed) : seed(seed)
+{
+	int i, j, k;
+	uint64_t state = seed;
+
+	for (i = 0; i < B; i++) {
+		p[i] = i;
+
+		g1[i] = (float)((int)(next(state) % (B + B)) - B) / B;
+
+		for (j = 0; j < 2; j++)
+			g2[i][j] = (float)((int)(next(state) % (B + B)) - B) / B;
+		normalize2(g2[i]);
+
+		for (j = 0; j < 3; j++)
+			g3[i][j] = (float)((int)(next(state) % (B + B)) - B) / B;
+		normalize3(g3[i]);
+	}
+
+	while (--i) {
+		k = p[i];
+		p[i] = p[j = (int)(next(state) % B)];
+		p[j] = k;
+	}
+
+	for (i = 0; i < B + 2; i++) {
+		p[B + i] = p[i];
+		g1[B + i] = g1[i];
+		for (j = 0; j < 2; j++)
+			g2[B + i][j] = g2[i][j];
+		for (j = 0; j < 3; j++)
+			g3[B + i][j] = g3[i][j];
+	}
+}
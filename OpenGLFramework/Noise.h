@@ -1,200 +1,123 @@
-#pragma once
-/* coherent noise function over 1, 2 or 3 dimensions */
-/* (copyright Ken Perlin) */
-
-#include <stdlib.h>
-#include <stdio.h>
-#include <math.h>
-
-#define B 0x100
-#define BM 0xff
-
-#define N 0x1000
-#define NP 12   /* 2^N */
-#define NM 0xfff
-
-static int   p[B + B + 2];
-static float g3[B + B + 2][3];
-static float g2[B + B + 2][2];
-static float g1[B + B + 2];
-static int   start = 1;
-
-static void init(void);
-
-#define s_curve(t) ( t * t * (3. - 2. * t) )
-
-#define lerp(t, a, b) ( a + t * (b - a) )
-
-#define setup(i,b0,b1,r0,r1)\
-	t = vec[i] + N;\
-	b0 = ((int)t) & BM;\
-	b1 = (b0+1) & BM;\
-	r0 = t - (int)t;\
-	r1 = r0 - 1.;
-
-double noise1(double arg)
-{
-	int bx0, bx1;
-	float rx0, rx1, sx, t, u, v, vec[1];
-
-	vec[0] = arg;
-	if (start) {
-		start = 0;
-		init();
-	}
-
-	setup(0, bx0, bx1, rx0, rx1);
-
-	sx = s_curve(rx0);
-
-	u = rx0 * g1[p[bx0]];
-	v = rx1 * g1[p[bx1]];
-
-	return lerp(sx, u, v);
-}
-
-float noise2(float vec[2])
-{
-	int bx0, bx1, by0, by1, b00, b10, b01, b11;
-	float rx0, rx1, ry0, ry1, * q, sx, sy, a, b, t, u, v;
-	register int i, j;
-
-	if (start) {
-		start = 0;
-		init();
-	}
-
-	setup(0, bx0, bx1, rx0, rx1);
-	setup(1, by0, by1, ry0, ry1);
-
-	i = p[bx0];
-	j = p[bx1];
-
-	b00 = p[i + by0];
-	b10 = p[j + by0];
-	b01 = p[i + by1];
-	b11 = p[j + by1];
-
-	sx = s_curve(rx0);
-	sy = s_curve(ry0);
-
-#define at2(rx,ry) ( rx * q[0] + ry * q[1] )
-
-	q = g2[b00]; u = at2(rx0, ry0);
-	q = g2[b10]; v = at2(rx1, ry0);
-	a = lerp(sx, u, v);
-
-	q = g2[b01]; u = at2(rx0, ry1);
-	q = g2[b11]; v = at2(rx1, ry1);
-	b = lerp(sx, u, v);
-
-	return lerp(sy, a, b);
-}
-
-float noise3(float vec[3])
-{
-	int bx0, bx1, by0, by1, bz0, bz1, b00, b10, b01, b11;
-	float rx0, rx1, ry0, ry1, rz0, rz1, * q, sy, sz, a, b, c, d, t, u, v;
-	register int i, j;
-
-	if (start) {
-		start = 0;
-		init();
-	}
-
-	setup(0, bx0, bx1, rx0, rx1);
-	setup(1, by0, by1, ry0, ry1);
-	setup(2, bz0, bz1, rz0, rz1);
-
-	i = p[bx0];
-	j = p[bx1];
-
-	b00 = p[i + by0];
-	b10 = p[j + by0];
-	b01 = p[i + by1];
-	b11 = p[j + by1];
-
-	t = s_curve(rx0);
-	sy = s_curve(ry0);
-	sz = s_curve(rz0);
-
-#define at3(rx,ry,rz) ( rx * q[0] + ry * q[1] + rz * q[2] )
-
-	q = g3[b00 + bz0]; u = at3(rx0, ry0, rz0);
-	q = g3[b10 + bz0]; v = at3(rx1, ry0, rz0);
-	a = lerp(t, u, v);
-
-	q = g3[b01 + bz0]; u = at3(rx0, ry1, rz0);
-	q = g3[b11 + bz0]; v = at3(rx1, ry1, rz0);
-	b = lerp(t, u, v);
-
-	c = lerp(sy, a, b);
-
-	q = g3[b00 + bz1]; u = at3(rx0, ry0, rz1);
-	q = g3[b10 + bz1]; v = at3(rx1, ry0, rz1);
-	a = lerp(t, u, v);
-
-	q = g3[b01 + bz1]; u = at3(rx0, ry1, rz1);
-	q = g3[b11 + bz1]; v = at3(rx1, ry1, rz1);
-	b = lerp(t, u, v);
-
-	d = lerp(sy, a, b);
-
-	return lerp(sz, c, d);
-}
-
-static void normalize2(float v[2])
-{
-	float s;
-
-	s = sqrt(v[0] * v[0] + v[1] * v[1]);
-	v[0] = v[0] / s;
-	v[1] = v[1] / s;
-}
-
-static void normalize3(float v[3])
-{
-	float s;
-
-	s = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
-	v[0] = v[0] / s;
-	v[1] = v[1] / s;
-	v[2] = v[2] / s;
-}
-
-static void init(void)
-{
-	int i, j, k;
-	/* initialize random number generator */
-	time_t t;
-	srand((unsigned)time(&t));
-
-	for (i = 0; i < B; i++) {
-		p[i] = i;
-
-		g1[i] = (float)((rand() % (B + B)) - B) / B;
-
-		for (j = 0; j < 2; j++)
-			g2[i][j] = (float)((rand() % (B + B)) - B) / B;
-		normalize2(g2[i]);
-
-		for (j = 0; j < 3; j++)
-			g3[i][j] = (float)((rand() % (B + B)) - B) / B;
-		normalize3(g3[i]);
-	}
-
-	while (--i) {
-		k = p[i];
-		p[i] = p[j = rand() % B];
-		p[j] = k;
-	}
-
-	for (i = 0; i < B + 2; i++) {
-		p[B + i] = p[i];
-		g1[B + i] = g1[i];
-		for (j = 0; j < 2; j++)
-			g2[B + i][j] = g2[i][j];
-		for (j = 0; j < 3; j++)
-			g3[B + i][j] = g3[i][j];
-	}
-}
\ No newline at end of file
+#pragma once
+/* coherent noise function over 1, 2 or 3 dimensions */
+/* (copyright Ken Perlin) */
+
+#include <stdint.h>
+#include <memory>
+
+enum NoiseType
+{
+	NOISE_PERLIN,       // classic gradient noise, 8 lattice corners per sample
+	NOISE_SIMPLEX       // simplex noise, 4 simplex corners per sample
+};
+
+/*
+ * A 3D noise primitive. The terrain fBm only talks to this interface, so
+ * backends can be swapped without touching the sampling code.
+ */
+class NoiseBackend
+{
+public:
+	virtual ~NoiseBackend() {}
+
+	virtual float noise3(const float vec[3]) const = 0;
+	virtual void noise3(const float* x, const float* y, const float* z, float* out, int count) const = 0;
+
+	// value plus its analytic gradient d(noise)/d(vec), from the same
+	// corner lookups the value needs
+	virtual float noise3(const float vec[3], float grad[3]) const = 0;
+	virtual void noise3(const float* x, const float* y, const float* z, float* out,
+	                    float* dx, float* dy, float* dz, int count) const = 0;
+
+	virtual const char* getName() const = 0;
+};
+
+/*
+ * The seeded permutation and gradient tables the evaluators below read.
+ * They are filled once from the 64-bit seed and never written again, so one
+ * set may be shared by any number of evaluators and threads. The same seed
+ * always produces the same tables on every platform.
+ */
+class NoiseTables
+{
+public:
+	static const int TABLE_SIZE = 0x100;
+
+	explicit NoiseTables(uint64_t seed = 0);
+
+	uint64_t getSeed() const { return seed; }
+
+private:
+	friend class NoiseContext;
+	friend class SimplexNoise;
+
+	uint64_t seed;
+	int   p[TABLE_SIZE + TABLE_SIZE + 2];
+	float g3[TABLE_SIZE + TABLE_SIZE + 2][3];
+	float g2[TABLE_SIZE + TABLE_SIZE + 2][2];
+	float g1[TABLE_SIZE + TABLE_SIZE + 2];
+};
+
+/*
+ * Classic Perlin gradient noise over a set of tables: 8 lattice corners per
+ * 3D sample, plus the 1D and 2D variants. Evaluators over the same tables
+ * may be used side by side; one built from a seed gets tables of its own.
+ */
+class NoiseContext : public NoiseBackend
+{
+public:
+	explicit NoiseContext(uint64_t seed = 0);
+	explicit NoiseContext(std::shared_ptr<const NoiseTables> tables) : tables(std::move(tables)) {}
+
+	uint64_t getSeed() const { return tables->getSeed(); }
+
+	double noise1(double arg) const;
+	float noise2(const float vec[2]) const;
+	float noise3(const float vec[3]) const override;
+
+	// evaluate noise3 at count points given as separate x/y/z arrays,
+	// 8 (AVX2) or 4 (SSE4.1) points at a time when the CPU allows it
+	void noise3(const float* x, const float* y, const float* z, float* out, int count) const override;
+
+	float noise3(const float vec[3], float grad[3]) const override;
+	void noise3(const float* x, const float* y, const float* z, float* out,
+	            float* dx, float* dy, float* dz, int count) const override;
+
+	const char* getName() const override { return "perlin"; }
+
+	// # of points the batched noise3 evaluates per step on this CPU (8, 4 or 1)
+	static int batchWidth();
+
+private:
+	std::shared_ptr<const NoiseTables> tables;
+};
+
+/*
+ * 3D simplex noise over a set of tables: each sample sums the radially
+ * attenuated gradients of the 4 corners of the simplex holding it, instead
+ * of interpolating 8 cube corners, and shows no axis-aligned artifacts.
+ * Scaled to roughly the amplitude of the Perlin backend so the grammar's
+ * smoothness factor means the same thing for both.
+ */
+class SimplexNoise : public NoiseBackend
+{
+public:
+	explicit SimplexNoise(uint64_t seed = 0);
+	explicit SimplexNoise(std::shared_ptr<const NoiseTables> tables) : tables(std::move(tables)) {}
+
+	uint64_t getSeed() const { return tables->getSeed(); }
+
+	float noise3(const float vec[3]) const override;
+	void noise3(const float* x, const float* y, const float* z, float* out, int count) const override;
+
+	float noise3(const float vec[3], float grad[3]) const override;
+	void noise3(const float* x, const float* y, const float* z, float* out,
+	            float* dx, float* dy, float* dz, int count) const override;
+
+	const char* getName() const override { return "simplex"; }
+
+private:
+	void corners(const float vec[3], float x[4], float y[4], float z[4], int c[4]) const;
+
+	std::shared_ptr<const NoiseTables> tables;
+};
@@ -10,26 +10,121 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #ifdef _WIN32
+#define NOMINMAX        // keep std::min/std::max usable
 #include <windows.h>    // include windows.h to avoid thousands of compile errors even though this class is not depending on Windows
 #endif
 
-#ifdef __APPLE__
-#include <OpenGL/gl.h>
-#else
-#include <GL/gl.h>
-#endif
+#include "GL/glew.h"     // buffer objects; includes gl.h
 
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
 #include <cmath>
+#include <algorithm>
 #include "Planet.h"
 #include "Noise.h"
+#include "ThreadPool.h"
+#include "MappedFile.h"
+#include "VertexCache.h"
+#include "glm/packing.hpp"
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wstrict-aliasing" // glm's half packing type-puns
+#endif
+#include "glm/gtc/packing.hpp"
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
 
 
 
 // constants //////////////////////////////////////////////////////////////////
 const int MIN_SECTOR_COUNT = 3;
 const int MIN_STACK_COUNT  = 2;
+const int MAX_SECTOR_COUNT = 16383; // one stack of the separate layout must fit a sub-mesh
+const unsigned int MAX_SUBMESH_VERTICES = 65535;   // 0xffff is left free as a restart index
+const unsigned short RESTART_INDEX = 0xffff;        // ends a triangle strip
+const int VERTEX_CACHE_SIZE = 16;   // post-transform cache the triangle order is tuned for
+const int MAX_OCTAVE_COUNT = 16;    // beyond this noise coords run out of float precision
+
+// biome names in the grammar, in Biome order
+const char* BIOME_NAMES[BIOME_COUNT] = { "water", "ice", "sand", "grass", "rock", "snow" };
+
+// names of the biome table's zones and bands in the grammar, in table order
+const char* BIOME_ZONE_NAMES[BIOME_ZONE_COUNT] = { "temperate", "arctic", "frozen" };
+const char* BIOME_BAND_NAMES[BIOME_BAND_COUNT] = { "sea", "beach", "land", "alpine" };
+
+// cube faces as (normal, right, down); down = right x normal keeps the grid
+// winding the same as the UV grid, so triangles face outward on every face
+const float CUBE_FACES[6][3][3] = {
+    { { 1, 0, 0}, { 0, 1, 0}, { 0, 0,-1} },     // +x
+    { { 0, 1, 0}, {-1, 0, 0}, { 0, 0,-1} },     // +y
+    { {-1, 0, 0}, { 0,-1, 0}, { 0, 0,-1} },     // -x
+    { { 0,-1, 0}, { 1, 0, 0}, { 0, 0,-1} },     // -y
+    { { 0, 0, 1}, { 0, 1, 0}, { 1, 0, 0} },     // +z (north)
+    { { 0, 0,-1}, { 0, 1, 0}, {-1, 0, 0} }      // -z (south)
+};
+
+// heightfield cache: this header, then rows x columns heights, then
+// rows x columns x 3 slopes if it has them, as native floats
+// bump the version whenever the noise or the sampling changes
+const char     HEIGHTFIELD_MAGIC[4]  = { 'P', 'G', 'H', 'F' };
+const uint32_t HEIGHTFIELD_VERSION   = 1;
+const uint32_t HEIGHTFIELD_BYTEORDER = 0x01020304;
+
+struct HeightfieldHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;                 // HEIGHTFIELD_BYTEORDER as written
+    int32_t rows, columns;
+    int32_t topology, sectorCount, stackCount;
+    int32_t noise;
+    int32_t octaves;                    // resolved count, so auto is covered
+    float lacunarity, gain;
+    float radius, res;
+    float minHeight, maxHeight;         // results, not inputs
+    int32_t slopes;                     // 1 if slopes follow the heights
+    uint32_t reserved[3];               // keeps the samples 16-byte aligned
+    uint64_t seed;
+    uint64_t grammarHash;
+};
+static_assert(sizeof(HeightfieldHeader) == 96, "heightfield cache header must not be padded");
+
+// mesh cache: this header, then the interleaved vertices, the triangle
+// indices and the line indices (16 bits each), exactly as they are drawn;
+// the sub-mesh table follows from the grid, so it is rebuilt, not stored;
+// little-endian only, so big-endian machines never read or write one
+const char     MESH_MAGIC[4] = { 'P', 'G', 'M', 'S' };
+const uint32_t MESH_VERSION  = 6;
+
+struct MeshHeader
+{
+    char magic[4];
+    uint32_t version;
+    HeightfieldHeader heightfield;      // heights the mesh was displaced from
+    double R, M, day;
+    float K, temp, water;
+    float palette[BIOME_COUNT][3];
+    unsigned char biomeTable[2][BIOME_ZONE_COUNT][BIOME_BAND_COUNT];
+    int32_t terrestrial, analyticNormals, sharedVertices;
+    int32_t interleavedStride;
+    int32_t triangleStrips;
+    int32_t shaderClassification, reserved;
+    uint32_t vertexCount, normalCount, colorCount;  // as printSelf() reports them
+    uint32_t indexCount, lineIndexCount, triangleCount;
+};
+static_assert(sizeof(MeshHeader) == 288, "mesh cache header must not be padded");
+
+static bool isLittleEndian()
+{
+    const uint32_t one = 1;
+    return *(const unsigned char*)&one == 1;
+}
 
 
 
@@ -38,6 +133,20 @@ const int MIN_STACK_COUNT  = 2;
 ///////////////////////////////////////////////////////////////////////////////
 Planet::Planet(Params params, float radius, int sectors, int stacks) : interleavedStride(40)
 {
+    copyParams(params);
+    set(radius, sectors, stacks);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// take the generation parameters over, without regenerating anything
+///////////////////////////////////////////////////////////////////////////////
+void Planet::copyParams(const Params& params)
+{
+    cacheFile = params.cacheFile;
+    meshCacheFile = params.meshCacheFile;
+    grammarHash = params.grammarHash;
     R = params.R;
     M = params.M;
     day = params.D;
@@ -45,8 +154,26 @@ Planet::Planet(Params params, float radius, int sectors, int stacks) : interleav
     temp = params.T;
     water = params.W;
     terrestrial = params.terrestrial;
-    red = params.red; green = params.green; blue = params.blue;
-    set(radius, sectors, stacks);
+    memcpy(palette, params.palette, sizeof(palette));
+    memcpy(biomeTable, params.biomeTable, sizeof(biomeTable));
+    if(params.seed != noiseTables->getSeed())
+    {
+        noiseTables = std::make_shared<NoiseTables>(params.seed);
+        noise = NoiseContext(noiseTables);
+        simplex = SimplexNoise(noiseTables);
+    }
+    noiseType = params.noise;
+    analyticNormals = params.analyticNormals;
+    sharedVertices = params.sharedVertices;
+    packedVertices = params.packedVertices;
+    triangleStrips = params.triangleStrips && params.sharedVertices;
+    gpuOnly = params.gpuOnly;
+    shaderClassification = params.shaderClassification && !params.packedVertices;
+    interleavedStride = packedVertices ? sizeof(PackedVertex) : 10 * sizeof(float);
+    topology = params.topology;
+    octaves = params.octaves;
+    lacunarity = params.lacunarity;
+    gain = params.gain;
 }
 
 
@@ -60,13 +187,35 @@ void Planet::set(float radius, int sectors, int stacks)
     this->sectorCount = sectors;
     if(sectors < MIN_SECTOR_COUNT)
         this->sectorCount = MIN_SECTOR_COUNT;
+    if(sectors > MAX_SECTOR_COUNT)
+    {
+        std::cerr << "Planet: " << sectors << " sectors capped at " << MAX_SECTOR_COUNT << std::endl;
+        this->sectorCount = MAX_SECTOR_COUNT;
+    }
     this->stackCount = stacks;
-    if(sectors < MIN_STACK_COUNT)
-        this->sectorCount = MIN_STACK_COUNT;
-    setTexture(stacks, sectors);
-    
+    if(stacks < MIN_STACK_COUNT)
+        this->stackCount = MIN_STACK_COUNT;
+    faceSize = std::max(1, sectorCount / 4);    // same spacing as the UV equator
+
+    int rows = getGridRowCount();
+    int columns = getGridColumnCount();
+    if(loadMesh(rows, columns))
+    {
+        // the heights are only needed again if the parameters change later;
+        // mapping them costs nothing until then
+        if(!loadTexture(rows, columns))
+            heightfield.release();
+        return;
+    }
+
+    if(!loadTexture(rows, columns))
+    {
+        setTexture(rows, columns);
+        saveTexture(rows, columns);
+    }
 
     buildVertices();
+    saveMesh(rows, columns);
 }
 
 void Planet::setRadius(float radius)
@@ -87,527 +236,2322 @@ void Planet::setStackCount(int stacks)
         set(radius, sectorCount, stacks);
 }
 
-float recnoise(float vec[3], float freq=1, float size=1) {
-    if (freq > 32) return 0;
-    else {
-        float coord[3] = { vec[0] * freq, vec[1] * freq, vec[2] * freq };
 
-        return noise3(coord) * size + recnoise(vec, freq * 2, size / 2);
-    }
-}
 
-void Planet::setTexture(int stacks, int sectors)
+///////////////////////////////////////////////////////////////////////////////
+// switch to new parameters, rerunning only the stages they invalidate
+// the noise is only resampled if the heightfield itself changes; height
+// scale, water level and shape changes rebuild the mesh from the cached
+// heightfield, temperature changes reclassify the biomes and palette changes
+// only look them up again (until upload() frees them); if the shader classifies the terrain, none of the
+// last three regenerates anything
+// returns the first stage that was rerun
+///////////////////////////////////////////////////////////////////////////////
+Stage Planet::setParams(const Params& params)
 {
-    // texture goes from 0 - stacks and 0 - sectors (inclusive)
-    tex = new float* [stacks + 1];
-    for (int i = 0; i <= stacks; i++) {
-        tex[i] = new float[sectors + 1];
+    Stage stage = getInvalidatedStage(params);
+    gpuOnly = params.gpuOnly;               // takes effect at the next upload()
+    if(stage == STAGE_NONE)
+    {
+        // a shader classifying the terrain reads these every frame
+        temp = params.T;
+        water = params.W;
+        terrestrial = params.terrestrial;
+        memcpy(palette, params.palette, sizeof(palette));
+        memcpy(biomeTable, params.biomeTable, sizeof(biomeTable));
+        return stage;
     }
 
-    const float PI = acos(-1);
-
-    float sectorStep = 2 * PI / sectors;
-    float stackStep = PI / stacks;
-    float sectorAngle, stackAngle;
+    // without heights (the mesh came from the cache, theirs did not) nothing
+    // can be rebuilt; a mapped mesh has no colour arrays to rewrite in place
+    if(heightfield.isEmpty())
+        stage = STAGE_HEIGHTFIELD;
+    else if(stage <= STAGE_COLOR && hasCachedCounts())
+        stage = STAGE_MESH;
 
-    // compute all vertices first, each vertex contains (x,y,z,s,t) except normal
-    for (int i = 0; i <= stacks; ++i)
+    copyParams(params);
+    if(stage == STAGE_HEIGHTFIELD)
     {
-        stackAngle = PI / 2 - i * stackStep;        // starting from pi/2 to -pi/2
-
-        for (int j = 0; j <= sectors; ++j)
-        {
-            // std::cout << i << ", " << j << std::endl;
-            sectorAngle = j * sectorStep;           // starting from 0 to 2pi
-
-            float xy = radius * cosf(stackAngle);       // r * cos(u)
-            float z = radius * sinf(stackAngle);        // r * sin(u)
-
-            float x = xy * cosf(sectorAngle);      // x = r * cos(u) * cos(v)
-            float y = xy * sinf(sectorAngle);      // y = r * cos(u) * sin(v)
-
-            float c[3] = { x * res, y * res, z * res };
-            tex[i][j] = recnoise(c);
-
-            if (tex[i][j] < minHeight) minHeight = tex[i][j];
-            else if (tex[i][j] > maxHeight) maxHeight = tex[i][j];
-
-            //std::cout << tex[i][j] << ", ";
-        }
-        //std::cout << std::endl;
+        set(radius, sectorCount, stackCount);
+        return stage;
     }
-    // std::cout << "Texture set." << std::endl;
 
-    dH = maxHeight - minHeight;
+    if(stage == STAGE_MESH)
+        buildVertices();
+    else
+        buildColors(stage == STAGE_COLOR);
+    saveMesh(getGridRowCount(), getGridColumnCount());
+    return stage;
 }
 
-
-
-///////////////////////////////////////////////////////////////////////////////
-// print itself
-///////////////////////////////////////////////////////////////////////////////
-void Planet::printSelf() const
+// the earliest stage that depends on a parameter that differs from params
+Stage Planet::getInvalidatedStage(const Params& params) const
 {
-    std::cout << "===== Planet =====\n"
-              << "        Radius: " << radius << "\n"
-              << "  Sector Count: " << sectorCount << "\n"
-              << "   Stack Count: " << stackCount << "\n"
-              << "Triangle Count: " << getTriangleCount() << "\n"
-              << "   Index Count: " << getIndexCount() << "\n"
-              << "  Vertex Count: " << getVertexCount() << "\n"
-              << "  Normal Count: " << getNormalCount() << "\n"
-              << "   Color Count: " << getColorCount() << std::endl;
+    if(params.seed != getSeed() || params.noise != noiseType ||
+       params.octaves != octaves || params.lacunarity != lacunarity || params.gain != gain ||
+       params.topology != topology ||
+       (params.analyticNormals && !heightfield.hasSlopes()))                // slopes were never sampled
+        return STAGE_HEIGHTFIELD;
+
+    // the water level flattens the sea floor, so it moves vertices too,
+    // unless the shader flattens it
+    bool classified = params.shaderClassification && !params.packedVertices;
+    if(params.S != K || params.R != R || params.M != M || params.D != day ||
+       (params.W != water && !classified) || classified != shaderClassification ||
+       params.analyticNormals != analyticNormals ||
+       params.sharedVertices != sharedVertices || params.packedVertices != packedVertices ||
+       (params.triangleStrips && params.sharedVertices) != triangleStrips ||
+       (streamsReleased && !params.gpuOnly))                // the CPU copies are wanted back
+        return STAGE_MESH;
+
+    if(classified)
+        return STAGE_NONE;
+
+    if(params.T != temp || params.terrestrial != terrestrial ||
+       memcmp(params.biomeTable, biomeTable, sizeof(biomeTable)) != 0)
+        return STAGE_COLOR;
+
+    if(!std::equal(&params.palette[0][0], &params.palette[0][0] + BIOME_COUNT * 3, &palette[0][0]))
+        return biomes.empty() ? STAGE_COLOR : STAGE_PALETTE;     // uploaded, see upload()
+
+    return STAGE_NONE;
 }
 
-
-
 ///////////////////////////////////////////////////////////////////////////////
-// draw a Planet in VertexArray mode
-// OpenGL RC must be set before calling it
+// per-row scratch for fbm(): sample points plus one octave of output
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::draw() const
+struct NoiseRow
 {
-    // interleaved array
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glEnableClientState(GL_NORMAL_ARRAY);
-    glEnableClientState(GL_COLOR_ARRAY);
-
-    glVertexPointer(3, GL_FLOAT, interleavedStride, &interleavedVertices[0]);
-    glNormalPointer(GL_FLOAT, interleavedStride, &interleavedVertices[3]);
-    glColorPointer(4, GL_FLOAT, interleavedStride, &interleavedVertices[6]);
+    std::vector<float> x, y, z;             // sample points, scaled in place per octave
+    std::vector<float> octave;              // one octave of noise
+    std::vector<float> dx, dy, dz;          // its gradient, if asked for
 
-    glDrawElements(GL_TRIANGLES, (unsigned int)indices.size(), GL_UNSIGNED_INT, indices.data());
-
-    glDisableClientState(GL_VERTEX_ARRAY);
-    glDisableClientState(GL_NORMAL_ARRAY);
-    glDisableClientState(GL_COLOR_ARRAY);
-}
+    explicit NoiseRow(int count) : x(count), y(count), z(count), octave(count),
+                                   dx(count), dy(count), dz(count) {}
+};
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// draw lines only
-// the caller must set the line width before call this
+// fractal Brownian motion: sum octaves of noise at count points, scaling the
+// frequency by lacunarity and the amplitude by gain after each octave
+// each octave is one batched noise3 call over the whole row
+// if grad is not null, the analytic gradient of the sum w.r.t. the sample
+// point is written there as well (x,y,z per point), at no extra noise lookups
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::drawLines(const float lineColor[4]) const
+void fbm(const NoiseBackend& noise, int octaves, float lacunarity, float gain,
+         NoiseRow& row, float* out, float* grad, int count)
 {
-    // set line colour
-    glColor4fv(lineColor);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE,   lineColor);
-
-    // draw lines with VA
-    glDisable(GL_LIGHTING);
-    glEnableClientState(GL_VERTEX_ARRAY);
-    glVertexPointer(3, GL_FLOAT, 0, vertices.data());
+    for (int k = 0; k < count; ++k)
+        out[k] = 0;
+    if (grad)
+    {
+        for (int k = 0; k < count * 3; ++k)
+            grad[k] = 0;
+    }
 
-    glDrawElements(GL_LINES, (unsigned int)lineIndices.size(), GL_UNSIGNED_INT, lineIndices.data());
+    float size = 1, freq = 1;
+    for (int i = 0; i < octaves; ++i, size *= gain, freq *= lacunarity)
+    {
+        if (grad)
+        {
+            // d/dp noise(p * freq) = freq * noise'(p * freq)
+            noise.noise3(row.x.data(), row.y.data(), row.z.data(), row.octave.data(),
+                         row.dx.data(), row.dy.data(), row.dz.data(), count);
+            for (int k = 0; k < count; ++k)
+            {
+                grad[3 * k]     += row.dx[k] * size * freq;
+                grad[3 * k + 1] += row.dy[k] * size * freq;
+                grad[3 * k + 2] += row.dz[k] * size * freq;
+            }
+        }
+        else
+            noise.noise3(row.x.data(), row.y.data(), row.z.data(), row.octave.data(), count);
 
-    glDisableClientState(GL_VERTEX_ARRAY);
-    glEnable(GL_LIGHTING);
+        for (int k = 0; k < count; ++k)
+        {
+            out[k] += row.octave[k] * size;
+            row.x[k] *= lacunarity;
+            row.y[k] *= lacunarity;
+            row.z[k] *= lacunarity;
+        }
+    }
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// draw a Planet surfaces and lines on top of it
-// the caller must set the line width before call this
+// max distance between the surface and the sphere of the planet's radius:
+// the terrain height plus the equatorial bulge
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::drawWithLines(const float lineColor[4]) const
+float Planet::getRelief() const
 {
-    glEnable(GL_POLYGON_OFFSET_FILL);
-    glPolygonOffset(1.0, 1.0f); // move polygon backward
-    this->draw();
-    glDisable(GL_POLYGON_OFFSET_FILL);
-
-    // draw lines with VA
-    drawLines(lineColor);
+    // the same bulge displaceVertex() adds, so the LOD bounds always hold
+    return std::max(std::fabs(heightfield.getMinHeight()), std::fabs(heightfield.getMaxHeight())) * K + (float)getOblateness();
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// dealloc vectors
+// noise backend the terrain is built from
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::clearArrays()
+const NoiseBackend& Planet::getNoise() const
 {
-    std::vector<float>().swap(vertices);
-    std::vector<float>().swap(normals);
-    std::vector<float>().swap(colors);
-    std::vector<unsigned int>().swap(indices);
-    std::vector<unsigned int>().swap(lineIndices);
+    if (noiseType == NOISE_SIMPLEX)
+        return simplex;
+    return noise;
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// generate vertices with flat shading
-// each triangle is independent (no shared vertices)
+// # of fBm octaves to sum
+// in auto mode, stop once an octave's wavelength (1 / freq in noise space)
+// is shorter than the widest gap between neighbouring vertices; finer detail
+// cannot be represented by the mesh and would only alias
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::buildVertices()
+int Planet::getOctaveCount() const
 {
-    std::vector<Vertex> tmpVertices;
-
-    float sectorStep = 2 * PI / sectorCount;
-    float stackStep = PI / stackCount;
-    float sectorAngle, stackAngle;
-    double omega = 2 * dPI / day;
-    double h = pow(R, 4) * pow(omega, 2) / (G * M);
-    h = h / R;  //normalize to 1
+    if (octaves > 0)
+        return octaves;
 
-    // compute all vertices first, each vertex contains (x,y,z,s,t) except normal
-    for(int i = 0; i <= stackCount; ++i)
-    {
-        stackAngle = PI / 2 - i * stackStep;        // starting from pi/2 to -pi/2
+    if (topology == TOPOLOGY_CUBE)
+        return getOctaveCount(PI / 2 / faceSize);
+    return getOctaveCount(std::max(2 * PI / sectorCount, PI / stackCount));
+}
 
-        // add (sectorCount+1) vertices per stack
-        // the first and last vertices have same position and normal, but different tex coords
-        for(int j = 0; j <= sectorCount; ++j)
-        {
-            // std::cout << i << ", " << j << std::endl;
-            sectorAngle = j * sectorStep;           // starting from 0 to 2pi
-            
-            float adjRadius1 = radius + tex[i][j] * K;
-            float adjRadius2;
-
-            if (adjRadius1 < radius + (minHeight + dH * water) * K) {
-                adjRadius2 = radius + (minHeight + dH * water) * K + tex[i][j] * pow(K, 2); // smooth out water
-            }
-            else adjRadius2 = adjRadius1;
-            float xy = (adjRadius2 + h) * cosf(stackAngle); // r * cos(u); adjust for oblateness
-            float z = adjRadius2 * sinf(stackAngle);        // r * sin(u)
+// auto octave count for vertices spaced the given angle (radians) apart
+int Planet::getOctaveCount(float angle) const
+{
+    if (lacunarity <= 1.0f)
+        return 1;
+
+    float spacing = angle * radius * res;
+    int count = 1;
+    for (float freq = lacunarity; 1 / freq >= spacing && count < MAX_OCTAVE_COUNT; freq *= lacunarity)
+        ++count;
+    return count;
+}
 
-            Vertex vertex;
-            vertex.x = xy * cosf(sectorAngle);      // x = r * cos(u) * cos(v)
-            vertex.y = xy * sinf(sectorAngle);      // y = r * cos(u) * sin(v)
-            vertex.z = z;                           // z = r * sin(u)
 
-            float vec[3] = { vertex.x, vertex.y, vertex.z };
-            Vertex color = colorVertex('e', adjRadius1, stackAngle, vec);
 
-            vertex.r = color.r;
-            vertex.g = color.g;
-            vertex.b = color.b;
-            vertex.a = color.a;
+///////////////////////////////////////////////////////////////////////////////
+// sample the terrain height (and its slope) at every grid point
+///////////////////////////////////////////////////////////////////////////////
+void Planet::setTexture(int rows, int columns)
+{
+    // one sample per grid point, rows x columns, plus the slope along the
+    // sphere (3 floats per sample) for analytic normals; a heightfield of
+    // the same size is overwritten in place
+    heightfield.resize(rows, columns, analyticNormals);
 
-            tmpVertices.push_back(vertex);
-        }
-    }
+    // noise is evaluated a whole grid row at a time, bands of rows in parallel
+    const NoiseBackend& terrain = getNoise();
+    int octaveCount = getOctaveCount();
 
-    // clear memory of prev arrays
-    clearArrays();
+    ThreadPool& pool = ThreadPool::instance();
+    int grain = std::max(1, rows / pool.getChunkTarget());
+    int chunks = (rows + grain - 1) / grain;
 
-    Vertex v1, v2, v3, v4;                          // 4 vertex positions and tex coords
-    std::vector<float> n;                           // 1 face normal
+    // min/max are reduced per band, then across bands; both start at sea level
+    std::vector<float> bandMin(chunks, 0.0f), bandMax(chunks, 0.0f);
 
-    int i, j, k, vi1, vi2;
-    int index = 0;                                  // index for vertex
-    for(i = 0; i < stackCount; ++i)
+    pool.parallelFor(0, rows, grain, [&](int first, int last)
     {
-        vi1 = i * (sectorCount + 1);                // index of tmpVertices
-        vi2 = (i + 1) * (sectorCount + 1);
+        NoiseRow row(columns);
+        float& lo = bandMin[first / grain];
+        float& hi = bandMax[first / grain];
+        float u[3], latitude;
 
-        for(j = 0; j < sectorCount; ++j, ++vi1, ++vi2)
+        for (int i = first; i < last; ++i)
         {
-            // get 4 vertices per sector
-            //  v1--v3
-            //  |    |
-            //  v2--v4
-            v1 = tmpVertices[vi1];
-            v2 = tmpVertices[vi2];
-            v3 = tmpVertices[vi1 + 1];
-            v4 = tmpVertices[vi2 + 1];
-
-            // if 1st stack and last stack, store only 1 triangle per sector
-            // otherwise, store 2 triangles (quad) per sector
-            if(i == 0) // a triangle for first stack ==========================
+            for (int j = 0; j < columns; ++j)
             {
-                // put a triangle
-                addVertex(v1.x, v1.y, v1.z);
-                addVertex(v2.x, v2.y, v2.z);
-                addVertex(v4.x, v4.y, v4.z);
-
-                // put color of triangle (temp red)
-                addColor(v1.r, v1.g, v1.b, v1.a);
-                addColor(v2.r, v2.g, v2.b, v2.a);
-                addColor(v4.r, v4.g, v4.b, v4.a);
-
-                // put normal
-                n = computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v4.x,v4.y,v4.z);
-                for(k = 0; k < 3; ++k)  // same normals for 3 vertices
-                {
-                    addNormal(n[0], n[1], n[2]);
-                }
-
-                // put indices of 1 triangle
-                addIndices(index, index+1, index+2);
+                getGridDirection(i, j, u, latitude);
+                row.x[j] = u[0] * radius * res;
+                row.y[j] = u[1] * radius * res;
+                row.z[j] = u[2] * radius * res;
+            }
 
-                // indices for line (first stack requires only vertical line)
-                lineIndices.push_back(index);
-                lineIndices.push_back(index+1);
+            float* heights = heightfield.getRow(i);
+            float* slopes = heightfield.getSlopes(i);
+            fbm(terrain, octaveCount, lacunarity, gain, row, heights, slopes, columns);
 
-                index += 3;     // for next
+            for (int j = 0; j < columns; ++j)
+            {
+                lo = std::min(lo, heights[j]);
+                hi = std::max(hi, heights[j]);
             }
-            else if(i == (stackCount-1)) // a triangle for last stack =========
+
+            if (slopes)
             {
-                // put a triangle
-                addVertex(v1.x, v1.y, v1.z);
-                addVertex(v2.x, v2.y, v2.z);
-                addVertex(v3.x, v3.y, v3.z);
-
-                // put color of triangle (temp red)
-                addColor(v1.r, v1.g, v1.b, v1.a);
-                addColor(v2.r, v2.g, v2.b, v2.a);
-                addColor(v3.r, v3.g, v3.b, v3.a);
-
-                // put normal
-                n = computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v3.x,v3.y,v3.z);
-                for(k = 0; k < 3; ++k)  // same normals for 3 vertices
+                // the noise is sampled at p = u * radius * res, so the slope over the
+                // unit sphere is radius * res times the gradient's tangential part
+                for (int j = 0; j < columns; ++j)
                 {
-                    addNormal(n[0], n[1], n[2]);
+                    getGridDirection(i, j, u, latitude);
+                    float* g = &slopes[3 * j];
+                    float gu = g[0] * u[0] + g[1] * u[1] + g[2] * u[2];
+                    for (int k = 0; k < 3; ++k)
+                        g[k] = (g[k] - gu * u[k]) * radius * res;
                 }
+            }
+        }
+    });
 
-                // put indices of 1 triangle
-                addIndices(index, index+1, index+2);
+    heightfield.setRange(*std::min_element(bandMin.begin(), bandMin.end()),
+                         *std::max_element(bandMax.begin(), bandMax.end()));
+}
 
-                // indices for lines (last stack requires both vert/hori lines)
-                lineIndices.push_back(index);
-                lineIndices.push_back(index+1);
-                lineIndices.push_back(index);
-                lineIndices.push_back(index+2);
 
-                index += 3;     // for next
-            }
-            else // 2 triangles for others ====================================
-            {
-                // put quad vertices: v1-v2-v3-v4
-                addVertex(v1.x, v1.y, v1.z);
-                addVertex(v2.x, v2.y, v2.z);
-                addVertex(v3.x, v3.y, v3.z);
-                addVertex(v4.x, v4.y, v4.z);
-
-                // put color of quad (temp red)
-                addColor(v1.r, v1.g, v1.b, v1.a);
-                addColor(v2.r, v2.g, v2.b, v2.a);
-                addColor(v3.r, v3.g, v3.b, v3.a);
-                addColor(v4.r, v4.g, v4.b, v4.a);
-
-                // put normal
-                n = computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v3.x,v3.y,v3.z);
-                for(k = 0; k < 4; ++k)  // same normals for 4 vertices
-                {
-                    addNormal(n[0], n[1], n[2]);
-                }
 
-                // put indices of quad (2 triangles)
-                addIndices(index, index+1, index+2);
-                addIndices(index+2, index+1, index+3);
+///////////////////////////////////////////////////////////////////////////////
+// header the heightfield cache of this planet should have
+///////////////////////////////////////////////////////////////////////////////
+void Planet::fillHeader(HeightfieldHeader& header, int rows, int columns) const
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HEIGHTFIELD_MAGIC, sizeof(header.magic));
+    header.version = HEIGHTFIELD_VERSION;
+    header.byteOrder = HEIGHTFIELD_BYTEORDER;
+    header.rows = rows;
+    header.columns = columns;
+    header.topology = topology;
+    header.sectorCount = sectorCount;
+    header.stackCount = stackCount;
+    header.noise = noiseType;
+    header.octaves = getOctaveCount();
+    header.lacunarity = lacunarity;
+    header.gain = gain;
+    header.radius = radius;
+    header.res = res;
+    header.minHeight = heightfield.getMinHeight();
+    header.maxHeight = heightfield.getMaxHeight();
+    header.slopes = heightfield.hasSlopes() ? 1 : 0;
+    header.seed = getSeed();
+    header.grammarHash = grammarHash;
+}
 
-                // indices for lines
-                lineIndices.push_back(index);
-                lineIndices.push_back(index+1);
-                lineIndices.push_back(index);
-                lineIndices.push_back(index+2);
 
-                index += 4;     // for next
-            }
-        }
-    }
 
-    // generate interleaved vertex array as well
-    buildInterleavedVertices();
+///////////////////////////////////////////////////////////////////////////////
+// use the cached heightfield if it was sampled with exactly these settings
+// the file is mapped and the heightfield points straight into it, so nothing
+// is read or copied up front; nothing writes to it once it has been sampled
+// returns false if there is no cache or it is stale, damaged or from a
+// different grammar; the caller then samples the noise and rewrites it
+///////////////////////////////////////////////////////////////////////////////
+bool Planet::loadTexture(int rows, int columns)
+{
+    if(cacheFile.empty())
+        return false;
+
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if(!file->open(cacheFile.c_str()) || file->getSize() < sizeof(HeightfieldHeader))
+        return false;
+
+    HeightfieldHeader header, expected;
+    memcpy(&header, file->getData(), sizeof(header));
+    fillHeader(expected, rows, columns);
+    expected.slopes = analyticNormals ? 1 : 0;
+    expected.minHeight = header.minHeight;
+    expected.maxHeight = header.maxHeight;
+
+    std::size_t samples = (std::size_t)rows * columns;
+    std::size_t size = sizeof(header) + samples * sizeof(float) * (expected.slopes ? 4 : 1);
+    if(memcmp(&header, &expected, sizeof(header)) != 0 || file->getSize() != size)
+        return false;
+
+    const float* heights = (const float*)((const char*)file->getData() + sizeof(header));
+    heightfield.map(file, heights, analyticNormals ? heights + samples : 0, rows, columns);
+    heightfield.setRange(header.minHeight, header.maxHeight);
+    return true;
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// Color selected vertex based on a few parameters
+// write the freshly sampled heightfield to the cache
+// it goes to a temporary file first, so a crash never leaves half a cache
 ///////////////////////////////////////////////////////////////////////////////
-Vertex Planet::colorVertex(char c, float aR, float latitude, float vec[3])
+bool Planet::saveTexture(int rows, int columns)
 {
-    Vertex v;
-    float absLat = sqrt(pow(latitude, 2));  // get magnitude of latitude
-    float localTemp = (temp + 45) - absLat * 180 / PI;  // get temperature at absLat
-    float coeff = 0.85 / 15 * localTemp;
-    if (coeff > 0.91) coeff = 0.91;                     // cap snow to still appear at lower latitudes
-    float snowHeight = (minHeight + coeff * dH) * K;    // snow is a function of temp + altitude
-    float waterHeight = (minHeight + water * dH) * K;
-    float sandHeight = waterHeight + (snowHeight - waterHeight) * 0.08;
-
-    if ((absLat - PI / 4) * 180 / PI > temp &&
-        rand() % 50 * 0.01 < pow(absLat - (PI / 4 + temp * PI / 180), 0.25) &&
-        water > 0.0) {  // define planet arctic circle and add randomness
-        if (aR > radius + waterHeight) {
-            // snow
-            v.r = 1.0;
-            v.g = 0.98;
-            v.b = 0.98;
-        }
-        else {
-            if (rand() % 50 * 0.01 < pow(absLat - (PI / 4 + temp * PI / 180), 0.9)) {
-                v.r = 180.0 / 255.0;
-                v.g = 207.0 / 255.0;
-                v.b = 250.0 / 255.0;
-            }
-            else {
-                // water
-                v.r = 0.0;
-                v.g = 94.0 / 255.0;
-                v.b = 184.0 / 255.0;
-            }
-        }
-    }
-    else if (aR <= radius + waterHeight &&
-        water > 0.0) {
-        // water
-        v.r = 0.0;
-        v.g = 94.0 / 255.0;
-        v.b = 184.0 / 255.0;
-    }
-    else if (aR < radius + sandHeight && terrestrial) {
-        v.r = 0.761;
-        v.g = 0.698;
-        v.b = 0.502;
-    }
-    else if (aR > radius + snowHeight &&
-        water > 0.0) {  // lim x->inf, recnoise->2
-        // snow
-        v.r = 1.0;
-        v.g = 0.98;
-        v.b = 0.98;
-    }
-    else {
-        if (terrestrial) {
-            // grass
-            v.r = 0.0;
-            v.g = 154.0 / 255.0;
-            v.b = 23.0 / 255.0;
-        }
-        else {
-            float noise = noise1(latitude * 2);
-            v.r = red + noise;
-            v.g = green + noise;
-            v.b = blue + noise;
-        }
+    if(cacheFile.empty())
+        return false;
+
+    HeightfieldHeader header;
+    fillHeader(header, rows, columns);
+
+    // the file has no row padding
+    std::string tmpFile = cacheFile + ".tmp";
+    std::ofstream out(tmpFile.c_str(), std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    for(int i = 0; i < rows; ++i)
+        out.write((const char*)heightfield.getRow(i), columns * sizeof(float));
+    for(int i = 0; i < rows && heightfield.hasSlopes(); ++i)
+        out.write((const char*)heightfield.getSlopes(i), columns * 3 * sizeof(float));
+    out.close();
+
+    if(!out)
+    {
+        std::remove(tmpFile.c_str());
+        return false;
     }
-        
-
-    return v;
+    std::remove(cacheFile.c_str());        // rename() does not replace files on Windows
+    return std::rename(tmpFile.c_str(), cacheFile.c_str()) == 0;
 }
 
+
+
 ///////////////////////////////////////////////////////////////////////////////
-// generate interleaved vertices: V/N/T
-// stride must be 32 bytes
+// header the mesh cache of this planet should have
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::buildInterleavedVertices()
+void Planet::fillHeader(MeshHeader& header, int rows, int columns) const
 {
-    std::vector<float>().swap(interleavedVertices);
-
-    std::size_t i, j, k;
-    std::size_t count = vertices.size();
-    for(i = 0, j = 0, k = 0; i < count; i += 3, j += 4)
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_MAGIC, sizeof(header.magic));
+    header.version = MESH_VERSION;
+    fillHeader(header.heightfield, rows, columns);
+    header.heightfield.slopes = analyticNormals ? 1 : 0;
+    header.R = R;
+    header.M = M;
+    header.day = day;
+    header.K = K;
+    header.temp = temp;
+    header.water = water;
+    memcpy(header.palette, palette, sizeof(palette));
+    memcpy(header.biomeTable, biomeTable, sizeof(biomeTable));
+    header.terrestrial = terrestrial ? 1 : 0;
+    header.analyticNormals = analyticNormals ? 1 : 0;
+    header.sharedVertices = sharedVertices ? 1 : 0;
+    header.interleavedStride = interleavedStride;
+    header.triangleStrips = triangleStrips ? 1 : 0;
+    header.shaderClassification = shaderClassification ? 1 : 0;
+    if(shaderClassification)
     {
-        interleavedVertices.push_back(vertices[i]);
-        interleavedVertices.push_back(vertices[i+1]);
-        interleavedVertices.push_back(vertices[i+2]);
+        // uniforms then, not part of the mesh
+        header.temp = header.water = 0;
+        header.terrestrial = 0;
+        memset(header.palette, 0, sizeof(header.palette));
+        memset(header.biomeTable, 0, sizeof(header.biomeTable));
+    }
+    header.vertexCount = getVertexCount();
+    header.normalCount = getNormalCount();
+    header.colorCount = getColorCount();
+    header.indexCount = getIndexCount();
+    header.lineIndexCount = getLineIndexCount();
+    header.triangleCount = getTriangleCount();
+}
 
-        interleavedVertices.push_back(normals[i]);
-        interleavedVertices.push_back(normals[i+1]);
-        interleavedVertices.push_back(normals[i+2]);
 
-        interleavedVertices.push_back(colors[j]);
-        interleavedVertices.push_back(colors[j+1]);
-        interleavedVertices.push_back(colors[j+2]);
-        interleavedVertices.push_back(colors[j+3]);
-    }
+
+///////////////////////////////////////////////////////////////////////////////
+// use the cached mesh if it was built with exactly these settings
+// the streams are mapped, not read: the getters and draw() point straight
+// into the file, so startup copies nothing before the GPU does
+///////////////////////////////////////////////////////////////////////////////
+bool Planet::loadMesh(int rows, int columns)
+{
+    if(meshCacheFile.empty() || !isLittleEndian())
+        return false;
+
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if(!file->open(meshCacheFile.c_str()) || file->getSize() < sizeof(MeshHeader))
+        return false;
+
+    MeshHeader header, expected;
+    memcpy(&header, file->getData(), sizeof(header));
+    fillHeader(expected, rows, columns);
+
+    // results, not inputs
+    expected.heightfield.minHeight = header.heightfield.minHeight;
+    expected.heightfield.maxHeight = header.heightfield.maxHeight;
+    expected.vertexCount = header.vertexCount;
+    expected.normalCount = header.normalCount;
+    expected.colorCount = header.colorCount;
+    expected.indexCount = header.indexCount;
+    expected.lineIndexCount = header.lineIndexCount;
+    expected.triangleCount = header.triangleCount;
+
+    std::size_t size = sizeof(header) + (std::size_t)header.vertexCount * interleavedStride +
+                       ((std::size_t)header.indexCount + header.lineIndexCount) * sizeof(unsigned short);
+    if(memcmp(&header, &expected, sizeof(header)) != 0 || file->getSize() != size)
+        return false;
+
+    const char* data = (const char*)file->getData() + sizeof(header);
+    cachedInterleaved = data;
+    cachedIndices = (const unsigned short*)(data + (std::size_t)header.vertexCount * interleavedStride);
+    cachedLineIndices = cachedIndices + header.indexCount;
+    cachedVertexCount = header.vertexCount;
+    cachedIndexCount = header.indexCount;
+    cachedLineIndexCount = header.lineIndexCount;
+
+    heightfield.setRange(header.heightfield.minHeight, header.heightfield.maxHeight);
+    meshFile = file;
+    uploadStage = STAGE_MESH;
+    buildSubMeshes();
+
+    // a previously built mesh is not used while the cache is
+    streamsReleased = false;
+    clearArrays();
+    return true;
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// add single vertex to array
+// free the vectors of the mesh (swapped out, so their memory goes too)
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::addVertex(float x, float y, float z)
+void Planet::clearArrays()
 {
-    vertices.push_back(x);
-    vertices.push_back(y);
-    vertices.push_back(z);
+    std::vector<float>().swap(vertices);
+    std::vector<float>().swap(normals);
+    std::vector<float>().swap(colors);
+    std::vector<float>().swap(interleavedVertices);
+    std::vector<PackedVertex>().swap(packedStream);
+    std::vector<unsigned short>().swap(indices);
+    std::vector<unsigned short>().swap(lineIndices);
+    std::vector<unsigned int>().swap(gridIndices);
+    std::vector<unsigned char>().swap(biomes);
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// add single normal to array
+// write the freshly built mesh to the cache, through a temporary file
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::addNormal(float nx, float ny, float nz)
+bool Planet::saveMesh(int rows, int columns)
 {
-    normals.push_back(nx);
-    normals.push_back(ny);
-    normals.push_back(nz);
+    if(meshCacheFile.empty() || !isLittleEndian() || meshFile)
+        return false;
+
+    MeshHeader header;
+    fillHeader(header, rows, columns);
+
+    std::string tmpFile = meshCacheFile + ".tmp";
+    std::ofstream out(tmpFile.c_str(), std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)getInterleavedData(), getInterleavedVertexSize());
+    // the lines go in too, for mapped meshes; if only the cache wanted
+    // them they are freed again
+    bool linesBuilt = hasLineIndices();
+    out.write((const char*)indices.data(), indices.size() * sizeof(unsigned short));
+    out.write((const char*)getLineIndices(), getLineIndexSize());
+    if(!linesBuilt)
+        std::vector<unsigned short>().swap(lineIndices);
+    out.close();
+
+    if(!out)
+    {
+        std::remove(tmpFile.c_str());
+        return false;
+    }
+    std::remove(meshCacheFile.c_str());
+    return std::rename(tmpFile.c_str(), meshCacheFile.c_str()) == 0;
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// add single color to array
+// print itself
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::addColor(float r, float g, float b, float a)
+void Planet::printSelf() const
 {
-    colors.push_back(r);
-    colors.push_back(g);
-    colors.push_back(b);
-    colors.push_back(a);
+    float acmr, atvr;
+    getCacheStats(acmr, atvr);
+    std::ostringstream cacheStats;
+    cacheStats << std::fixed << std::setprecision(3) << acmr << " / " << atvr;
+
+    std::cout << "===== Planet =====\n"
+              << "        Radius: " << radius << "\n"
+              << "  Sector Count: " << sectorCount << "\n"
+              << "   Stack Count: " << stackCount << "\n"
+              << "      Topology: " << (topology == TOPOLOGY_CUBE ? "cube" : "uv") << "\n"
+              << "          Seed: " << getSeed() << "\n"
+              << "         Noise: " << getNoise().getName() << "\n"
+              << "  Octave Count: " << getOctaveCount() << "\n"
+              << "   Heightfield: " << (heightfield.isMapped() ? "cached" : !heightfield.isEmpty() ? "sampled" : "none") << "\n"
+              << "          Mesh: " << (streamsReleased ? "GPU only" : meshFile ? "cached" : "built") << "\n"
+              << "Triangle Count: " << getTriangleCount() << "\n"
+              << "   Index Count: " << getIndexCount() << "\n"
+              << "    Sub-meshes: " << getSubMeshCount() << (triangleStrips ? " (16-bit strips)\n" : " (16-bit lists)\n")
+              << "     ACMR/ATVR: " << cacheStats.str() << " (" << VERTEX_CACHE_SIZE << "-entry FIFO)\n"
+              << "   Mesh Layout: " << (sharedVertices ? "shared" : "separate") << "\n"
+              << " Vertex Format: " << (packedVertices ? "packed" : "float") << " (" << interleavedStride << " bytes)\n"
+              << "       Colours: " << (shaderClassification ? "terrain inputs, classified per pixel" : "biome palette") << "\n"
+              << "  Vertex Count: " << getVertexCount() << "\n"
+              << "  Normal Count: " << getNormalCount() << "\n"
+              << "   Color Count: " << getColorCount() << std::endl;
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// add 3 indices to array
+// copy size bytes to the buffer bound to target, in place if the buffer
+// already has that size so the driver does not reallocate it
 ///////////////////////////////////////////////////////////////////////////////
-void Planet::addIndices(unsigned int i1, unsigned int i2, unsigned int i3)
+static void uploadBuffer(GLenum target, const void* data, std::size_t size, std::size_t& allocated)
 {
-    indices.push_back(i1);
-    indices.push_back(i2);
-    indices.push_back(i3);
+    if(size == allocated)
+    {
+        glBufferSubData(target, 0, size, data);
+        return;
+    }
+    glBufferData(target, size, data, GL_STATIC_DRAW);
+    allocated = size;
 }
 
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// return face normal of a triangle v1-v2-v3
-// if a triangle has no surface (normal length = 0), then return a zero vector
+// upload what was regenerated since the last call into buffer objects
+// colours are interleaved with the positions, so a recolour rewrites the
+// vertex buffer (in place) but leaves the index buffers alone
+// a GPU-only planet then frees its CPU copies
+// OpenGL RC must be set before calling it
 ///////////////////////////////////////////////////////////////////////////////
-std::vector<float> Planet::computeFaceNormal(float x1, float y1, float z1,  // v1
-                                             float x2, float y2, float z2,  // v2
-                                             float x3, float y3, float z3)  // v3
+void Planet::upload()
 {
-    const float EPSILON = 0.000001f;
+    if(buffers.vbo && uploadStage == STAGE_NONE)
+    {
+        if(gpuOnly)
+            releaseStreams();
+        return;
+    }
 
-    std::vector<float> normal(3, 0.0f);     // default return value (0,0,0)
-    float nx, ny, nz;
+    if(!buffers.vbo)
+    {
+        glGenBuffers(1, &buffers.vbo);
+        glGenBuffers(1, &buffers.ibo);
+        glGenBuffers(1, &buffers.lineIbo);
+        buffers.vboSize = buffers.iboSize = buffers.lineIboSize = 0;
+        uploadStage = STAGE_MESH;
+    }
 
-    // find 2 edge vectors: v1-v2, v1-v3
-    float ex1 = x2 - x1;
-    float ey1 = y2 - y1;
-    float ez1 = z2 - z1;
-    float ex2 = x3 - x1;
-    float ey2 = y3 - y1;
-    float ez2 = z3 - z1;
+    if(buffers.vao)
+        glBindVertexArray(0);               // keep the element buffer bindings out of it
 
-    // cross product: e1 x e2
-    nx = ey1 * ez2 - ez1 * ey2;
-    ny = ez1 * ex2 - ex1 * ez2;
-    nz = ex1 * ey2 - ey1 * ex2;
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+    uploadBuffer(GL_ARRAY_BUFFER, getInterleavedData(), getInterleavedVertexSize(), buffers.vboSize);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    // normalize only if the length is > 0
-    float length = sqrtf(nx * nx + ny * ny + nz * nz);
-    if(length > EPSILON)
+    if(uploadStage >= STAGE_MESH)
     {
-        // normalize
-        float lengthInv = 1.0f / length;
-        normal[0] = nx * lengthInv;
-        normal[1] = ny * lengthInv;
-        normal[2] = nz * lengthInv;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.ibo);
+        uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, getIndices(), getIndexSize(), buffers.iboSize);
+        // lines only if something built them; drawLines() copes without,
+        // and releaseStreams() uploads them before a GPU-only planet frees them
+        bool lines = hasLineIndices();
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.lineIbo);
+        uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, lines ? getLineIndices() : 0, lines ? getLineIndexSize() : 0, buffers.lineIboSize);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
     }
 
-    return normal;
+    // the VAO records the surface's pointers and index buffer; the buffer
+    // names never change, so only a new mesh (which may switch the vertex
+    // format) has to record them again
+    if(!buffers.vao && glGenVertexArrays)
+        glGenVertexArrays(1, &buffers.vao);
+    if(buffers.vao && uploadStage >= STAGE_MESH)
+    {
+        glBindVertexArray(buffers.vao);
+        bindBuffers();
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // the colours are in the vertex buffer now, so the biomes they were
+    // looked up from would only double them; a palette edit reclassifies
+    uploadStage = STAGE_NONE;
+    std::vector<unsigned char>().swap(biomes);
+    if(gpuOnly)
+        releaseStreams();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// delete the buffer objects and draw from client arrays again; a GPU-only
+// planet has none left, so it rebuilds them
+// OpenGL RC must be set before calling it
+///////////////////////////////////////////////////////////////////////////////
+void Planet::releaseBuffers()
+{
+    buffers.release();
+    uploadStage = STAGE_MESH;
+    if(streamsReleased)
+        restoreStreams();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// free the CPU copies of the uploaded mesh: the vectors, or the mapping of
+// the mesh cache; the counts and the sub-mesh table stay for drawing
+// the wireframe cannot be built without them, so it is uploaded first
+// OpenGL RC must be set before calling it
+///////////////////////////////////////////////////////////////////////////////
+void Planet::releaseStreams()
+{
+    if(streamsReleased || !buffers.vbo)
+        return;
+
+    if(buffers.lineIboSize == 0 && getLineIndexCount() > 0)
+    {
+        if(buffers.vao)
+            glBindVertexArray(0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.lineIbo);
+        uploadBuffer(GL_ELEMENT_ARRAY_BUFFER, getLineIndices(), getLineIndexSize(), buffers.lineIboSize);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    cachedVertexCount = getVertexCount();
+    cachedIndexCount = getIndexCount();
+    cachedLineIndexCount = getLineIndexCount();
+    cachedInterleaved = 0;
+    cachedIndices = cachedLineIndices = 0;
+    meshFile.reset();
+    clearArrays();
+    streamsReleased = true;
+}
+
+// the mesh again, from the heightfield if there is one, else from the caches
+void Planet::restoreStreams()
+{
+    if(heightfield.isEmpty())
+        set(radius, sectorCount, stackCount);
+    else
+        buildVertices();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// buffer object names: hand them over, or delete them
+///////////////////////////////////////////////////////////////////////////////
+void Planet::BufferObjects::take(BufferObjects& other)
+{
+    vao = other.vao;
+    vbo = other.vbo;
+    ibo = other.ibo;
+    lineIbo = other.lineIbo;
+    vboSize = other.vboSize;
+    iboSize = other.iboSize;
+    lineIboSize = other.lineIboSize;
+    other.vao = other.vbo = other.ibo = other.lineIbo = 0;
+    other.vboSize = other.iboSize = other.lineIboSize = 0;
+}
+
+void Planet::BufferObjects::release()
+{
+    if(vao)
+        glDeleteVertexArrays(1, &vao);
+    if(vbo)
+    {
+        glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ibo);
+        glDeleteBuffers(1, &lineIbo);
+    }
+    vao = vbo = ibo = lineIbo = 0;
+    vboSize = iboSize = lineIboSize = 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// point the fixed-function vertex, normal and colour arrays at an interleaved
+// stream, and the generic attributes too when there are shaders to read them
+// (in a compatibility context attribute 0 aliases the vertex array)
+// packed streams are PackedVertex; the GPU unpacks them as it fetches
+///////////////////////////////////////////////////////////////////////////////
+void Planet::enableArrays(const void* base, int stride, bool packed)
+{
+    const char* p = (const char*)base;
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    if(packed)
+    {
+        glVertexPointer(3, GL_HALF_FLOAT, stride, p + offsetof(PackedVertex, position));
+        glNormalPointer(GL_BYTE, stride, p + offsetof(PackedVertex, normal));
+        glColorPointer(4, GL_UNSIGNED_BYTE, stride, p + offsetof(PackedVertex, color));
+        if(!glVertexAttribPointer)
+            return;
+        glEnableVertexAttribArray(ATTRIB_POSITION);
+        glEnableVertexAttribArray(ATTRIB_NORMAL);
+        glEnableVertexAttribArray(ATTRIB_COLOR);
+        glVertexAttribPointer(ATTRIB_POSITION, 3, GL_HALF_FLOAT, GL_FALSE, stride, p + offsetof(PackedVertex, position));
+        glVertexAttribPointer(ATTRIB_NORMAL, 3, GL_BYTE, GL_TRUE, stride, p + offsetof(PackedVertex, normal));
+        glVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, p + offsetof(PackedVertex, color));
+        return;
+    }
+    glVertexPointer(3, GL_FLOAT, stride, p);
+    glNormalPointer(GL_FLOAT, stride, p + 3 * sizeof(float));
+    glColorPointer(4, GL_FLOAT, stride, p + 6 * sizeof(float));
+
+    if(!glVertexAttribPointer)
+        return;
+    glEnableVertexAttribArray(ATTRIB_POSITION);
+    glEnableVertexAttribArray(ATTRIB_NORMAL);
+    glEnableVertexAttribArray(ATTRIB_COLOR);
+    glVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, stride, p);
+    glVertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, stride, p + 3 * sizeof(float));
+    glVertexAttribPointer(ATTRIB_COLOR, 4, GL_FLOAT, GL_FALSE, stride, p + 6 * sizeof(float));
+}
+
+void Planet::disableArrays()
+{
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    if(!glVertexAttribPointer)
+        return;
+    glDisableVertexAttribArray(ATTRIB_POSITION);
+    glDisableVertexAttribArray(ATTRIB_NORMAL);
+    glDisableVertexAttribArray(ATTRIB_COLOR);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// point the arrays at the vertex buffer and bind the surface's index
+// buffer; this is the state the VAO holds
+///////////////////////////////////////////////////////////////////////////////
+void Planet::bindBuffers() const
+{
+    glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers.ibo);
+    enableArrays(0, interleavedStride, packedVertices);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// draw a Planet in VertexArray mode, or from its buffer objects
+// OpenGL RC must be set before calling it
+///////////////////////////////////////////////////////////////////////////////
+void Planet::draw() const
+{
+    if(buffers.vbo)
+    {
+        // the array buffer binding is not VAO state, but drawSubMeshes()
+        // may have to point the arrays into it again
+        if(buffers.vao)
+        {
+            glBindVertexArray(buffers.vao);
+            glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+        }
+        else
+            bindBuffers();
+
+        drawSubMeshes(false, 0, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        if(buffers.vao)
+        {
+            glBindVertexArray(0);
+            return;
+        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    else
+    {
+        // interleaved array
+        enableArrays(getInterleavedData(), interleavedStride, packedVertices);
+        drawSubMeshes(false, (const char*)getInterleavedData(), (const char*)getIndices());
+    }
+
+    disableArrays();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// draw the triangles or lines of every sub-mesh from the bound arrays
+// the bases are pointers, or offsets into the bound buffers; without
+// glDrawElementsBaseVertex (GL 3.2) the arrays are moved to each sub-mesh,
+// and without primitive restart (GL 3.1) every strip is drawn on its own
+///////////////////////////////////////////////////////////////////////////////
+void Planet::drawSubMeshes(bool lines, const char* vertexBase, const char* indexBase) const
+{
+    GLenum mode = lines ? GL_LINES : triangleStrips ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+    GLenum positionType = packedVertices ? GL_HALF_FLOAT : GL_FLOAT;
+
+    bool restart = mode == GL_TRIANGLE_STRIP && glPrimitiveRestartIndex;
+    if(restart)
+    {
+        glEnable(GL_PRIMITIVE_RESTART);
+        glPrimitiveRestartIndex(RESTART_INDEX);
+    }
+
+    // strips all have the same length: 2 indices per grid column, then a restart
+    GLsizei stripLength = getGridColumnCount() * 2;
+    bool splitStrips = mode == GL_TRIANGLE_STRIP && !restart;
+
+    for(const SubMesh& m : subMeshes)
+    {
+        GLsizei count = lines ? m.lineIndexCount : m.indexCount;
+        const char* first = indexBase + (lines ? m.firstLineIndex : m.firstIndex) * sizeof(unsigned short);
+        if(!glDrawElementsBaseVertex)
+        {
+            const char* base = vertexBase + (std::size_t)m.baseVertex * interleavedStride;
+            if(lines)
+                glVertexPointer(3, positionType, interleavedStride, base);
+            else
+                enableArrays(base, interleavedStride, packedVertices);
+        }
+
+        for(GLsizei drawn = 0; drawn < count; drawn += splitStrips ? stripLength + 1 : count)
+        {
+            GLsizei n = splitStrips ? stripLength : count;
+            const char* p = first + drawn * sizeof(unsigned short);
+            if(glDrawElementsBaseVertex)
+                glDrawElementsBaseVertex(mode, n, GL_UNSIGNED_SHORT, p, m.baseVertex);
+            else
+                glDrawElements(mode, n, GL_UNSIGNED_SHORT, p);
+        }
+    }
+
+    if(restart)
+        glDisable(GL_PRIMITIVE_RESTART);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// draw lines only
+// the caller must set the line width before call this
+///////////////////////////////////////////////////////////////////////////////
+void Planet::drawLines(const float lineColor[4]) const
+{
+    // set line colour
+    glColor4fv(lineColor);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE,   lineColor);
+
+    // draw lines with VA (positions only, so the line colour is used)
+    // positions lead both vertex formats
+    GLenum positionType = packedVertices ? GL_HALF_FLOAT : GL_FLOAT;
+    glDisable(GL_LIGHTING);
+    glEnableClientState(GL_VERTEX_ARRAY);
+
+    if(buffers.vbo)
+    {
+        // lines built after the upload are read from memory
+        bool uploaded = buffers.lineIboSize > 0;
+        const char* lines = uploaded ? 0 : (const char*)getLineIndices();
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, uploaded ? buffers.lineIbo : 0);
+        glVertexPointer(3, positionType, interleavedStride, (const void*)0);
+        if(uploaded || lines)
+            drawSubMeshes(true, 0, lines);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    else
+    {
+        glVertexPointer(3, positionType, interleavedStride, getInterleavedData());
+        drawSubMeshes(true, (const char*)getInterleavedData(), (const char*)getLineIndices());
+    }
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glEnable(GL_LIGHTING);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// draw a Planet surfaces and lines on top of it
+// the caller must set the line width before call this
+///////////////////////////////////////////////////////////////////////////////
+void Planet::drawWithLines(const float lineColor[4]) const
+{
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(1.0, 1.0f); // move polygon backward
+    this->draw();
+    glDisable(GL_POLYGON_OFFSET_FILL);
+
+    // draw lines with VA
+    drawLines(lineColor);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// size the arrays for a mesh of vertexCount vertices
+// storage is kept if it is already big enough, so regenerating a planet of
+// the same resolution does not touch the heap
+// the separate streams and the lines are derived from the mesh, so they are
+// dropped; flat normals of a packed mesh only need float positions to build
+///////////////////////////////////////////////////////////////////////////////
+void Planet::resizeArrays(std::size_t vertexCount, std::size_t indexCount)
+{
+    std::vector<float>().swap(vertices);
+    std::vector<float>().swap(normals);
+    std::vector<float>().swap(colors);
+    std::vector<unsigned short>().swap(lineIndices);
+    if(packedVertices && sharedVertices && !analyticNormals)
+        vertices.resize(vertexCount * 3);
+
+    interleavedVertices.resize(packedVertices ? 0 : vertexCount * 10);
+    packedStream.resize(packedVertices ? vertexCount : 0);
+    indices.resize(indexCount);
+    gridIndices.resize(vertexCount);
+    if(shaderClassification)
+        std::vector<unsigned char>().swap(biomes);  // the shader classifies
+    else
+        biomes.resize((std::size_t)getGridRowCount() * getGridColumnCount());
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// # of triangles of the surface, whatever the index format: 1 per sector in
+// the first and last stacks and 2 in the others, or 2 per cube quad
+// the strips at the poles also draw as many zero-area triangles
+///////////////////////////////////////////////////////////////////////////////
+unsigned int Planet::getTriangleCount() const
+{
+    if(topology == TOPOLOGY_CUBE)
+        return 6 * faceSize * faceSize * 2;
+    return sectorCount * (stackCount * 2 - 2);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// grid size: the UV grid has a row per stack boundary and a column per sector
+// boundary; the cube grid stacks its six faces, (faceSize+1)^2 points each,
+// on top of each other, so face f has rows f*(faceSize+1) .. f*(faceSize+1)+faceSize
+///////////////////////////////////////////////////////////////////////////////
+int Planet::getGridRowCount() const
+{
+    if(topology == TOPOLOGY_CUBE)
+        return 6 * (faceSize + 1);
+    return stackCount + 1;
+}
+
+int Planet::getGridColumnCount() const
+{
+    if(topology == TOPOLOGY_CUBE)
+        return faceSize + 1;
+    return sectorCount + 1;
+}
+
+// rows of quads (stacks for UV); cube faces do not join across their last row
+int Planet::getQuadRowCount() const
+{
+    if(topology == TOPOLOGY_CUBE)
+        return 6 * faceSize;
+    return stackCount;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// unit direction and latitude of a grid point
+// cube points are spaced at equal angles across each face (tan mapping), so
+// cells stay within ~30% of the same size instead of shrinking to the poles
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getGridDirection(int row, int column, float u[3], float& latitude) const
+{
+    if(topology == TOPOLOGY_CUBE)
+    {
+        float a = 2.0f * column / faceSize - 1;
+        float b = 2.0f * (row % (faceSize + 1)) / faceSize - 1;
+        getCubeDirection(row / (faceSize + 1), a, b, u);
+        latitude = asinf(std::max(-1.0f, std::min(1.0f, u[2])));
+        return;
+    }
+
+    float stackAngle = PI / 2 - row * PI / stackCount;         // starting from pi/2 to -pi/2
+    float sectorAngle = column * 2 * PI / sectorCount;         // starting from 0 to 2pi
+    u[0] = cosf(stackAngle) * cosf(sectorAngle);                // x = cos(u) * cos(v)
+    u[1] = cosf(stackAngle) * sinf(sectorAngle);                // y = cos(u) * sin(v)
+    u[2] = sinf(stackAngle);                                    // z = sin(u)
+    latitude = stackAngle;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// unit direction of point (a, b) of a cube face, a and b in [-1, 1]
+// a runs along the face's right axis, b along its down axis; both are angles
+// (a = 1 is 45 degrees off the face centre), so equal steps in a and b give
+// equal steps over the sphere
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getCubeDirection(int face, float a, float b, float u[3])
+{
+    const float QUARTER_PI = 0.785398163f;
+    const float (*axes)[3] = CUBE_FACES[face];
+    float x = tanf(a * QUARTER_PI);
+    float y = tanf(b * QUARTER_PI);
+    float lengthInv = 1.0f / sqrtf(1 + x * x + y * y);
+    for(int k = 0; k < 3; ++k)
+        u[k] = (axes[0][k] + x * axes[1][k] + y * axes[2][k]) * lengthInv;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// where stack i starts in the final arrays
+// the first and last stacks have 1 triangle per sector, the others 2, and the
+// first stack has only vertical lines, so every offset has a closed form and
+// each stack can be written without knowing what the others produced
+// the vertex offset is for the separate layout (3 or 4 vertices per sector)
+// cube grids are indexed by quad row instead of stack
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getStackOffsets(int i, std::size_t& vertex, std::size_t& index, std::size_t& lineIndex) const
+{
+    if(topology == TOPOLOGY_CUBE)
+    {
+        // 2 triangles (4 separate vertices) per quad; each quad row also
+        // closes its right edge, and the last row of a face its bottom edge
+        std::size_t n = faceSize;
+        vertex = i * n * 4;
+        index = i * n * 6;
+        lineIndex = i * (n * 4 + 2) + (i / n) * n * 2;
+    }
+    else
+    {
+        std::size_t sectors = sectorCount;
+        std::size_t stacks = i;
+        bool afterFirst = i > 0;
+        bool afterLast = i >= stackCount && stackCount > 1;
+
+        vertex = stacks * sectors * 4 - (afterFirst ? sectors : 0) - (afterLast ? sectors : 0);
+        index = stacks * sectors * 6 - (afterFirst ? sectors * 3 : 0) - (afterLast ? sectors * 3 : 0);
+        lineIndex = stacks * sectors * 4 - (afterFirst ? sectors * 2 : 0);
+    }
+
+    // one strip per stack, 2 indices per grid column and a restart index
+    if(triangleStrips)
+        index = (std::size_t)i * (getGridColumnCount() * 2 + 1);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// vertices [first, last) the triangles of stack i (cube: quad row i) use
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getStackVertexRange(int i, std::size_t& first, std::size_t& last) const
+{
+    std::size_t index, lineIndex;
+    if(!sharedVertices)
+    {
+        getStackOffsets(i, first, index, lineIndex);
+        getStackOffsets(i + 1, last, index, lineIndex);
+        return;
+    }
+
+    // the grid row above the stack and the one below it
+    std::size_t columns = getGridColumnCount();
+    std::size_t row = i;
+    if(topology == TOPOLOGY_CUBE)
+        row = i / faceSize * (faceSize + 1) + i % faceSize;
+    first = row * columns;
+    last = first + columns * 2;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// split the mesh into runs of whole stacks that each touch at most
+// MAX_SUBMESH_VERTICES vertices, so indices fit 16 bits relative to the
+// first vertex of their run; the first vertex of a stack never decreases,
+// so greedy runs are as long as they can be
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSubMeshes()
+{
+    subMeshes.clear();
+
+    int quadRows = getQuadRowCount();
+    for(int i = 0; i < quadRows; ++i)
+    {
+        std::size_t first, last;
+        getStackVertexRange(i, first, last);
+        if(subMeshes.empty() || last - subMeshes.back().baseVertex > MAX_SUBMESH_VERTICES)
+        {
+            SubMesh m = {};
+            m.firstRow = i;
+            m.baseVertex = (unsigned int)first;
+            subMeshes.push_back(m);
+        }
+        subMeshes.back().vertexCount = (unsigned int)(last - subMeshes.back().baseVertex);
+    }
+
+    std::size_t vertex, index, lineIndex, nextIndex, nextLineIndex;
+    for(std::size_t i = 0; i < subMeshes.size(); ++i)
+    {
+        SubMesh& m = subMeshes[i];
+        int nextRow = i + 1 < subMeshes.size() ? subMeshes[i + 1].firstRow : quadRows;
+        getStackOffsets(m.firstRow, vertex, index, lineIndex);
+        getStackOffsets(nextRow, vertex, nextIndex, nextLineIndex);
+        m.firstIndex = (unsigned int)index;
+        m.indexCount = (unsigned int)(nextIndex - index);
+        m.firstLineIndex = (unsigned int)lineIndex;
+        m.lineIndexCount = (unsigned int)(nextLineIndex - lineIndex);
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// base vertex of the sub-mesh stack i (cube: quad row i) belongs to
+///////////////////////////////////////////////////////////////////////////////
+unsigned int Planet::getBaseVertex(int i) const
+{
+    std::vector<SubMesh>::const_iterator it = std::upper_bound(subMeshes.begin(), subMeshes.end(), i,
+        [](int row, const SubMesh& m) { return row < m.firstRow; });
+    return (it - 1)->baseVertex;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// equatorial bulge from the planet's spin, added to the radius in x and y
+///////////////////////////////////////////////////////////////////////////////
+double Planet::getOblateness() const
+{
+    double omega = 2 * dPI / day;
+    double h = pow(R, 4) * pow(omega, 2) / (G * M);
+    return h / R;  //normalize to 1
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// displace the point at unit direction u by terrain height, then colour it
+// slope is the height's gradient along the unit sphere; with it the vertex
+// normal is computed analytically, without it the normal is left as is
+// if the shader classifies the terrain, the colour is its inputs instead, and
+// the sea floor is left for it to flatten too: both depend on the water level
+///////////////////////////////////////////////////////////////////////////////
+Vertex Planet::displaceVertex(const float u[3], float latitude, float height, const float* slope) const
+{
+    double h = getOblateness();
+
+    float adjRadius1 = radius + height * K;
+    float adjRadius2;
+    float dRadius = K;                          // d(radius) / d(height)
+
+    float minHeight = heightfield.getMinHeight(), dH = heightfield.getRange();
+    if (!shaderClassification && adjRadius1 < radius + (minHeight + dH * water) * K) {
+        adjRadius2 = radius + (minHeight + dH * water) * K + height * pow(K, 2); // smooth out water
+        dRadius = K * K;
+    }
+    else adjRadius2 = adjRadius1;
+
+    Vertex vertex;
+    vertex.x = (adjRadius2 + h) * u[0];         // adjust for oblateness
+    vertex.y = (adjRadius2 + h) * u[1];
+    vertex.z = adjRadius2 * u[2];
+
+    float c[4];
+    if (shaderClassification)
+        getTerrainInputs(u, latitude, height, c);
+    else
+    {
+        vertex.biome = classifyVertex(adjRadius1, u, latitude);
+        getBiomeColor(vertex.biome, latitude, c);
+    }
+    vertex.r = c[0];
+    vertex.g = c[1];
+    vertex.b = c[2];
+    vertex.a = c[3];
+
+    if (slope)
+    {
+        // surface r(u) * u has normal u - grad(r) / r, where grad(r) is
+        // the slope of the displacement along the sphere
+        float s = dRadius / adjRadius2;
+        float nx = u[0] - slope[0] * s;
+        float ny = u[1] - slope[1] * s;
+        float nz = u[2] - slope[2] * s;
+        float lengthInv = 1.0f / sqrtf(nx * nx + ny * ny + nz * nz);
+        vertex.nx = nx * lengthInv;
+        vertex.ny = ny * lengthInv;
+        vertex.nz = nz * lengthInv;
+    }
+    return vertex;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// compute the vertices of grid row i: displaced position,
+// colour and, if analytic, the normal
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildGridRow(int i, Vertex* row) const
+{
+    const float* heights = heightfield.getRow(i);
+    const float* slopes = heightfield.getSlopes(i);
+    float u[3], latitude;
+    for(int j = 0; j < getGridColumnCount(); ++j)
+    {
+        getGridDirection(i, j, u, latitude);
+        row[j] = displaceVertex(u, latitude, heights[j], slopes ? &slopes[3 * j] : 0);
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// sample the surface at count arbitrary unit directions (x,y,z each) with
+// the given # of octaves; used for LOD chunks finer than the planet's grid
+// normals are analytic, whatever the planet's own shading mode
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSurface(const float* directions, int count, int octaveCount, Vertex* out) const
+{
+    NoiseRow row(count);
+    std::vector<float> heights(count), slopes(count * 3);
+    for (int k = 0; k < count; ++k)
+    {
+        row.x[k] = directions[3 * k] * radius * res;
+        row.y[k] = directions[3 * k + 1] * radius * res;
+        row.z[k] = directions[3 * k + 2] * radius * res;
+    }
+
+    fbm(getNoise(), octaveCount, lacunarity, gain, row, heights.data(), slopes.data(), count);
+
+    for (int k = 0; k < count; ++k)
+    {
+        const float* u = &directions[3 * k];
+        float* g = &slopes[3 * k];
+        float gu = g[0] * u[0] + g[1] * u[1] + g[2] * u[2];
+        for (int i = 0; i < 3; ++i)
+            g[i] = (g[i] - gu * u[i]) * radius * res;
+
+        float latitude = asinf(std::max(-1.0f, std::min(1.0f, u[2])));
+        out[k] = displaceVertex(u, latitude, heights[k], g);
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// generate vertices
+// all array sizes are known up front, so the arrays are sized once and every
+// band of stacks writes its vertices (straight into the interleaved stream
+// too) and indices in place, in parallel, without further allocations
+// normals are per vertex from the noise gradient, or per face (flat shading)
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildVertices()
+{
+    meshFile.reset();                       // building into the vectors again
+    streamsReleased = false;
+    uploadStage = STAGE_MESH;
+
+    int rows = getGridRowCount();
+    int columns = getGridColumnCount();
+    int quadRows = getQuadRowCount();
+
+    std::size_t vertexCount, indexCount, lineIndexCount;
+    getStackOffsets(quadRows, vertexCount, indexCount, lineIndexCount);
+    if(sharedVertices)
+        vertexCount = (std::size_t)rows * columns;
+    resizeArrays(vertexCount, indexCount);
+    buildSubMeshes();
+
+    if(sharedVertices)
+    {
+        buildSharedVertices();
+        optimizeMesh();
+        return;
+    }
+
+    // corners are shared by up to 6 triangles, so compute the grid first
+    std::vector<Vertex> tmpVertices((std::size_t)rows * columns);
+
+    ThreadPool& pool = ThreadPool::instance();
+    int grain = std::max(1, rows / pool.getChunkTarget());
+    pool.parallelFor(0, rows, grain, [&](int first, int last)
+    {
+        for(int i = first; i < last; ++i)
+        {
+            std::size_t g = (std::size_t)i * columns;
+            buildGridRow(i, &tmpVertices[g]);
+            if(!biomes.empty())
+                for(int j = 0; j < columns; ++j)
+                    biomes[g + j] = tmpVertices[g + j].biome;
+        }
+    });
+
+    grain = std::max(1, quadRows / pool.getChunkTarget());
+    pool.parallelFor(0, quadRows, grain, [&](int first, int last)
+    {
+        if(topology == TOPOLOGY_CUBE)
+            buildSeparateQuads(tmpVertices, first, last);
+        else
+            buildSeparateVertices(tmpVertices, first, last);
+    });
+    optimizeMesh();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// rewrite the colour stream in place from the biome of every grid point,
+// reclassifying the grid points first if classify is set (as buildGridRow()
+// would, from the cached heightfield)
+// positions, normals and indices are left alone
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildColors(bool classify)
+{
+    uploadStage = std::max(uploadStage, classify ? STAGE_COLOR : STAGE_PALETTE);
+    std::vector<float>().swap(colors);      // out of date; taken again on use
+
+    int rows = getGridRowCount();
+    int columns = getGridColumnCount();
+    int count = (int)getVertexCount();
+    ThreadPool& pool = ThreadPool::instance();
+
+    if(classify)
+    {
+        biomes.resize((std::size_t)rows * columns);     // if upload() freed them
+        int grain = std::max(1, rows / pool.getChunkTarget());
+        pool.parallelFor(0, rows, grain, [&](int first, int last)
+        {
+            float u[3], latitude;
+            for(int i = first; i < last; ++i)
+            {
+                const float* heights = heightfield.getRow(i);
+                for(int j = 0; j < columns; ++j)
+                {
+                    getGridDirection(i, j, u, latitude);
+                    biomes[(std::size_t)i * columns + j] = classifyVertex(radius + heights[j] * K, u, latitude);
+                }
+            }
+        });
+    }
+
+    // the separate layout repeats grid points; a lookup is cheaper than
+    // colouring each point once and copying
+    int grain = std::max(1, count / pool.getChunkTarget());
+    pool.parallelFor(0, count, grain, [&](int first, int last)
+    {
+        float c[4];
+        for(int k = first; k < last; ++k)
+        {
+            getGridColor(gridIndices[k], c);
+            setInterleavedColor(k, c);
+        }
+    });
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// store vertex i, made from grid point gridIndex, in the interleaved stream
+// (and its float position, while a packed mesh needs it for flat normals)
+// the face normal is used instead of the vertex normal if not null
+///////////////////////////////////////////////////////////////////////////////
+void Planet::setVertex(std::size_t i, const Vertex& v, std::size_t gridIndex, const float* faceNormal)
+{
+    float n[3] = { v.nx, v.ny, v.nz };
+    if(faceNormal)
+    {
+        n[0] = faceNormal[0];  n[1] = faceNormal[1];  n[2] = faceNormal[2];
+    }
+    float c[4] = { v.r, v.g, v.b, v.a };
+
+    if(!vertices.empty())
+    {
+        float* p = &vertices[i * 3];
+        p[0] = v.x;  p[1] = v.y;  p[2] = v.z;
+    }
+
+    if(packedVertices)
+        packedStream[i].position = glm::packHalf4x16(glm::vec4(v.x, v.y, v.z, 1.0f));
+    else
+    {
+        float* iv = &interleavedVertices[i * 10];
+        iv[0] = v.x;  iv[1] = v.y;  iv[2] = v.z;
+    }
+    setInterleavedNormal(i, n);
+    setInterleavedColor(i, c);
+
+    gridIndices[i] = (unsigned int)gridIndex;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// write the normal or colour of vertex i into the interleaved stream,
+// packing it if the stream is packed
+///////////////////////////////////////////////////////////////////////////////
+void Planet::setInterleavedNormal(std::size_t i, const float n[3])
+{
+    if(packedVertices)
+    {
+        packedStream[i].normal = glm::packSnorm4x8(glm::vec4(n[0], n[1], n[2], 0.0f));
+        return;
+    }
+    float* iv = &interleavedVertices[i * 10 + 3];
+    iv[0] = n[0];  iv[1] = n[1];  iv[2] = n[2];
+}
+
+void Planet::setInterleavedColor(std::size_t i, const float c[4])
+{
+    if(packedVertices)
+    {
+        packedStream[i].color = glm::packUnorm4x8(glm::vec4(c[0], c[1], c[2], c[3]));
+        return;
+    }
+    float* iv = &interleavedVertices[i * 10 + 6];
+    iv[0] = c[0];  iv[1] = c[1];  iv[2] = c[2];  iv[3] = c[3];
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// move elements [lo, lo + order.size()) of a stream of width-element vertices
+// so that the one at order[s] ends up at lo + s
+///////////////////////////////////////////////////////////////////////////////
+template<class T>
+static void reorderStream(std::vector<T>& stream, std::size_t width, std::size_t lo,
+                          const std::vector<unsigned int>& order)
+{
+    if(stream.empty())
+        return;
+    std::vector<T> old(stream.begin() + lo * width, stream.begin() + (lo + order.size()) * width);
+    for(std::size_t s = 0; s < order.size(); ++s)
+        std::copy(old.begin() + (order[s] - lo) * width, old.begin() + (order[s] - lo + 1) * width,
+                  stream.begin() + (lo + s) * width);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// reorder every sub-mesh for the post-transform cache, then for fetching
+// the row-major sweep reloads a whole row of vertices per row of triangles;
+// sub-meshes are independent, so they are optimized in parallel
+// the separate layout has nothing to reuse (every triangle has its own
+// vertices) and is already fetched in order, and strips keep the grid's
+// own order, so both are left alone
+///////////////////////////////////////////////////////////////////////////////
+void Planet::optimizeMesh()
+{
+    if(!sharedVertices || triangleStrips)
+        return;
+
+    ThreadPool::instance().parallelFor(0, (int)subMeshes.size(), 1, [&](int first, int last)
+    {
+        for(int k = first; k < last; ++k)
+            optimizeSubMesh(k);
+    });
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// reorder the triangles of sub-mesh k with Tipsify, then renumber its
+// vertices in the order the new triangles first use them, so the vertex
+// stream is read nearly sequentially
+// in the shared layout neighbouring sub-meshes share the grid row between
+// them; those vertices stay where they are and only the rest move
+///////////////////////////////////////////////////////////////////////////////
+void Planet::optimizeSubMesh(int k)
+{
+    const SubMesh& m = subMeshes[k];
+    unsigned short* triangles = &indices[m.firstIndex];
+    VertexCache(VERTEX_CACHE_SIZE).optimize(triangles, m.indexCount, m.vertexCount);
+
+    // vertices only this sub-mesh uses, [lo, hi) relative to its base
+    std::size_t lo = 0, hi = m.vertexCount;
+    if(k > 0)
+        lo = std::max(lo, (std::size_t)subMeshes[k - 1].baseVertex + subMeshes[k - 1].vertexCount - m.baseVertex);
+    if(k + 1 < (int)subMeshes.size())
+        hi = std::min(hi, (std::size_t)subMeshes[k + 1].baseVertex - m.baseVertex);
+    if(lo >= hi)
+        return;
+
+    // new order of the movable vertices: first use, then any never used
+    std::vector<unsigned int> order;
+    std::vector<char> placed(hi - lo, 0);
+    order.reserve(hi - lo);
+    for(unsigned int i = 0; i < m.indexCount; ++i)
+    {
+        unsigned short v = triangles[i];
+        if(v >= lo && v < hi && !placed[v - lo])
+        {
+            placed[v - lo] = 1;
+            order.push_back(v);
+        }
+    }
+    for(std::size_t v = lo; v < hi; ++v)
+        if(!placed[v - lo])
+            order.push_back((unsigned int)v);
+
+    std::vector<unsigned short> remap(m.vertexCount);
+    for(std::size_t v = 0; v < remap.size(); ++v)
+        remap[v] = (unsigned short)v;
+    for(std::size_t s = 0; s < order.size(); ++s)
+        remap[order[s]] = (unsigned short)(lo + s);
+
+    for(unsigned int i = 0; i < m.indexCount; ++i)
+        triangles[i] = remap[triangles[i]];
+
+    // the order is relative to the base; the streams are not
+    for(std::size_t s = 0; s < order.size(); ++s)
+        order[s] += m.baseVertex;
+    std::size_t first = m.baseVertex + lo;
+    reorderStream(interleavedVertices, 10, first, order);
+    reorderStream(packedStream, 1, first, order);
+    reorderStream(gridIndices, 1, first, order);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// average cache miss ratio (transformed vertices per triangle, 0.5 at best
+// on a big grid) and average transform to vertex ratio (1.0 at best) of the
+// triangle order, replayed sub-mesh by sub-mesh through a FIFO cache
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getCacheStats(float& acmr, float& atvr) const
+{
+    VertexCache cache(VERTEX_CACHE_SIZE);
+    const unsigned short* triangles = getIndices();
+    acmr = atvr = 0;
+    if(!triangles)                          // freed after upload
+        return;
+
+    std::size_t misses = 0;
+    for(const SubMesh& m : subMeshes)
+        misses += cache.countMisses(triangles + m.firstIndex, m.indexCount, m.vertexCount);
+
+    acmr = getTriangleCount() ? (float)misses / getTriangleCount() : 0;
+    atvr = getVertexCount() ? (float)misses / getVertexCount() : 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// build the separate-layout mesh of stacks [firstStack, lastStack)
+// each triangle is independent (no shared vertices)
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSeparateVertices(const std::vector<Vertex>& tmpVertices, int firstStack, int lastStack)
+{
+    Vertex v1, v2, v3, v4;                          // 4 vertex positions and tex coords
+    float n[3];                                     // 1 face normal
+    const float* faceNormal = analyticNormals ? 0 : n;
+
+    int i, j, vi1, vi2;
+    std::size_t index, k, l;                        // next vertex, index (and line index)
+    for(i = firstStack; i < lastStack; ++i)
+    {
+        getStackOffsets(i, index, k, l);
+        std::size_t base = getBaseVertex(i);
+        vi1 = i * (sectorCount + 1);                // index of tmpVertices
+        vi2 = (i + 1) * (sectorCount + 1);
+
+        for(j = 0; j < sectorCount; ++j, ++vi1, ++vi2)
+        {
+            // get 4 vertices per sector
+            //  v1--v3
+            //  |    |
+            //  v2--v4
+            v1 = tmpVertices[vi1];
+            v2 = tmpVertices[vi2];
+            v3 = tmpVertices[vi1 + 1];
+            v4 = tmpVertices[vi2 + 1];
+            unsigned short v = (unsigned short)(index - base);  // index in the sub-mesh
+
+            // if 1st stack and last stack, store only 1 triangle per sector
+            // otherwise, store 2 triangles (quad) per sector
+            if(i == 0) // a triangle for first stack ==========================
+            {
+                // put a triangle
+                if(!analyticNormals)
+                    computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v4.x,v4.y,v4.z, n);
+                setVertex(index,   v1, vi1, faceNormal);
+                setVertex(index+1, v2, vi2, faceNormal);
+                setVertex(index+2, v4, vi2 + 1, faceNormal);
+
+                // put indices of 1 triangle
+                indices[k++] = v;
+                indices[k++] = v+1;
+                indices[k++] = v+2;
+
+                index += 3;     // for next
+            }
+            else if(i == (stackCount-1)) // a triangle for last stack =========
+            {
+                // put a triangle
+                if(!analyticNormals)
+                    computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v3.x,v3.y,v3.z, n);
+                setVertex(index,   v1, vi1, faceNormal);
+                setVertex(index+1, v2, vi2, faceNormal);
+                setVertex(index+2, v3, vi1 + 1, faceNormal);
+
+                // put indices of 1 triangle
+                indices[k++] = v;
+                indices[k++] = v+1;
+                indices[k++] = v+2;
+
+                index += 3;     // for next
+            }
+            else // 2 triangles for others ====================================
+            {
+                // put quad vertices: v1-v2-v3-v4
+                if(!analyticNormals)
+                    computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v3.x,v3.y,v3.z, n);
+                setVertex(index,   v1, vi1, faceNormal);
+                setVertex(index+1, v2, vi2, faceNormal);
+                setVertex(index+2, v3, vi1 + 1, faceNormal);
+                setVertex(index+3, v4, vi2 + 1, faceNormal);
+
+                // put indices of quad (2 triangles)
+                indices[k++] = v;
+                indices[k++] = v+1;
+                indices[k++] = v+2;
+                indices[k++] = v+2;
+                indices[k++] = v+1;
+                indices[k++] = v+3;
+
+                index += 4;     // for next
+            }
+        }
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// generate vertices with smooth shading
+// each grid vertex is stored once and shared by the triangles around it
+// normals are the analytic ones, or area-weighted averages of the faces
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSharedVertices()
+{
+    int rows = getGridRowCount();
+    int columns = getGridColumnCount();
+
+    ThreadPool& pool = ThreadPool::instance();
+    int grain = std::max(1, rows / pool.getChunkTarget());
+    pool.parallelFor(0, rows, grain, [&](int first, int last)
+    {
+        std::vector<Vertex> row(columns);
+        for(int i = first; i < last; ++i)
+        {
+            buildGridRow(i, row.data());
+            for(int j = 0; j < columns; ++j)
+            {
+                std::size_t g = (std::size_t)i * columns + j;
+                setVertex(g, row[j], g, 0);
+                if(!biomes.empty())
+                    biomes[g] = row[j].biome;
+            }
+
+            // quads below this row, if any
+            if(topology == TOPOLOGY_CUBE)
+            {
+                int face = i / (faceSize + 1), faceRow = i % (faceSize + 1);
+                if(faceRow < faceSize)
+                    buildSharedQuadIndices(face * faceSize + faceRow);
+            }
+            else if(i < stackCount)
+                buildSharedIndices(i);
+        }
+    });
+
+    if(analyticNormals)
+        return;
+
+    // sum the (area weighted) face normals around each vertex, then normalize
+    // faces of neighbouring bands share vertices, so this pass stays serial
+    // positions come from the float stream, or the copy a packed one keeps
+    std::vector<float> sums(getVertexCount() * 3, 0.0f);
+    auto position = [&](std::size_t v)
+    {
+        return packedVertices ? &vertices[v * 3] : &interleavedVertices[v * 10];
+    };
+    auto addFace = [&](std::size_t v1, std::size_t v2, std::size_t v3)
+    {
+        const float* p1 = position(v1);
+        const float* p2 = position(v2);
+        const float* p3 = position(v3);
+        float ex1 = p2[0] - p1[0], ey1 = p2[1] - p1[1], ez1 = p2[2] - p1[2];
+        float ex2 = p3[0] - p1[0], ey2 = p3[1] - p1[1], ez2 = p3[2] - p1[2];
+        float nx = ey1 * ez2 - ez1 * ey2;
+        float ny = ez1 * ex2 - ex1 * ez2;
+        float nz = ex1 * ey2 - ey1 * ex2;
+        for(std::size_t v : { v1, v2, v3 })
+        {
+            float* n = &sums[v * 3];
+            n[0] += nx;
+            n[1] += ny;
+            n[2] += nz;
+        }
+    };
+    for(const SubMesh& m : subMeshes)
+    {
+        const unsigned short* t = &indices[m.firstIndex];
+        std::size_t b = m.baseVertex;
+        if(!triangleStrips)
+        {
+            for(std::size_t i = 0; i < m.indexCount; i += 3)
+                addFace(b + t[i], b + t[i+1], b + t[i+2]);
+            continue;
+        }
+
+        // each strip index after the first two adds a triangle, every other
+        // one wound the other way round; zero-area ones add nothing
+        std::size_t length = 0;
+        for(std::size_t i = 0; i < m.indexCount; ++i)
+        {
+            if(t[i] == RESTART_INDEX)
+                length = 0;
+            else if(++length >= 3 && length % 2)
+                addFace(b + t[i-2], b + t[i-1], b + t[i]);
+            else if(length >= 3)
+                addFace(b + t[i-1], b + t[i-2], b + t[i]);
+        }
+    }
+    for(std::size_t i = 0; i < sums.size(); i += 3)
+    {
+        float length = sqrtf(sums[i] * sums[i] + sums[i+1] * sums[i+1] + sums[i+2] * sums[i+2]);
+        if(length > 0.000001f)
+        {
+            float lengthInv = 1.0f / length;
+            sums[i]   *= lengthInv;
+            sums[i+1] *= lengthInv;
+            sums[i+2] *= lengthInv;
+        }
+        setInterleavedNormal(i / 3, &sums[i]);
+    }
+    std::vector<float>().swap(vertices);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// triangle indices of stack i of the shared grid
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSharedIndices(int i)
+{
+    std::size_t vertex, k, l;
+    getStackOffsets(i, vertex, k, l);
+
+    //  k1--k1+1
+    //  |  / |
+    //  k2--k2+1
+    // relative to the sub-mesh the stack is in
+    unsigned short k1 = (unsigned short)(i * (sectorCount + 1) - getBaseVertex(i));    // beginning of current stack
+    unsigned short k2 = k1 + sectorCount + 1;       // beginning of next stack
+
+    if(triangleStrips)
+    {
+        buildStrip(k, k1, k2);
+        return;
+    }
+
+    // 1 triangle per sector for first and last stacks, 2 for others
+    for(int j = 0; j < sectorCount; ++j, ++k1, ++k2)
+    {
+        if(i == 0)
+        {
+            indices[k++] = k1;
+            indices[k++] = k2;
+            indices[k++] = k2 + 1;
+        }
+        else if(i == (stackCount-1))
+        {
+            indices[k++] = k1;
+            indices[k++] = k2;
+            indices[k++] = k1 + 1;
+        }
+        else
+        {
+            indices[k++] = k1;
+            indices[k++] = k2;
+            indices[k++] = k1 + 1;
+            indices[k++] = k1 + 1;
+            indices[k++] = k2;
+            indices[k++] = k2 + 1;
+        }
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// the triangles between grid rows starting at k1 and k2 as one strip that
+// zigzags k1, k2, k1+1, k2+1, ..., then a restart index; returns the index
+// after it. The strip's triangles wind like the list's, and at a pole, where
+// the k1 row is one point, every other triangle has zero area
+///////////////////////////////////////////////////////////////////////////////
+std::size_t Planet::buildStrip(std::size_t k, unsigned short k1, unsigned short k2)
+{
+    int columns = getGridColumnCount();
+    for(int j = 0; j < columns; ++j)
+    {
+        indices[k++] = k1 + j;
+        indices[k++] = k2 + j;
+    }
+    indices[k++] = RESTART_INDEX;
+    return k;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// build the separate-layout mesh of cube quad rows [firstRow, lastRow)
+// every quad gets its own 4 vertices and 2 triangles
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSeparateQuads(const std::vector<Vertex>& tmpVertices, int firstRow, int lastRow)
+{
+    float n[3];                                     // 1 face normal
+    const float* faceNormal = analyticNormals ? 0 : n;
+
+    std::size_t index, k, l;                        // next vertex, index (and line index)
+    for(int q = firstRow; q < lastRow; ++q)
+    {
+        getStackOffsets(q, index, k, l);
+        std::size_t base = getBaseVertex(q);
+        int faceRow = q % faceSize;
+        int vi1 = (q / faceSize * (faceSize + 1) + faceRow) * (faceSize + 1);  // index of tmpVertices
+        int vi2 = vi1 + faceSize + 1;
+
+        for(int j = 0; j < faceSize; ++j, ++vi1, ++vi2)
+        {
+            //  v1--v3
+            //  |  / |
+            //  v2--v4
+            const Vertex& v1 = tmpVertices[vi1];
+            const Vertex& v2 = tmpVertices[vi2];
+            const Vertex& v3 = tmpVertices[vi1 + 1];
+            const Vertex& v4 = tmpVertices[vi2 + 1];
+            unsigned short v = (unsigned short)(index - base);  // index in the sub-mesh
+
+            if(!analyticNormals)
+                computeFaceNormal(v1.x,v1.y,v1.z, v2.x,v2.y,v2.z, v3.x,v3.y,v3.z, n);
+            setVertex(index,   v1, vi1, faceNormal);
+            setVertex(index+1, v2, vi2, faceNormal);
+            setVertex(index+2, v3, vi1 + 1, faceNormal);
+            setVertex(index+3, v4, vi2 + 1, faceNormal);
+
+            indices[k++] = v;
+            indices[k++] = v+1;
+            indices[k++] = v+2;
+            indices[k++] = v+2;
+            indices[k++] = v+1;
+            indices[k++] = v+3;
+
+            index += 4;     // for next
+        }
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// triangle and line indices of quad row q of the shared cube grid
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildSharedQuadIndices(int q)
+{
+    std::size_t vertex, k, l;
+    getStackOffsets(q, vertex, k, l);
+
+    //  k1--k1+1
+    //  |  / |
+    //  k2--k2+1
+    int faceRow = q % faceSize;
+    unsigned short k1 = (unsigned short)((q / faceSize * (faceSize + 1) + faceRow) * (faceSize + 1) - getBaseVertex(q));
+    unsigned short k2 = k1 + faceSize + 1;
+
+    if(triangleStrips)
+    {
+        buildStrip(k, k1, k2);
+        return;
+    }
+
+    for(int j = 0; j < faceSize; ++j, ++k1, ++k2)
+    {
+        indices[k++] = k1;
+        indices[k++] = k2;
+        indices[k++] = k1 + 1;
+        indices[k++] = k1 + 1;
+        indices[k++] = k2;
+        indices[k++] = k2 + 1;
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// build the wireframe on first use: vertical and horizontal grid lines, no
+// diagonals, in the sub-meshes of the triangles
+// the shared layout is numbered as it was built and then mapped to where
+// optimizeMesh() moved each grid point, through gridIndices
+///////////////////////////////////////////////////////////////////////////////
+void Planet::buildLineIndices() const
+{
+    lineIndices.resize(getLineIndexCount());
+
+    std::vector<unsigned int> vertexOf;
+    if(sharedVertices)
+    {
+        vertexOf.resize(gridIndices.size());
+        for(std::size_t v = 0; v < gridIndices.size(); ++v)
+            vertexOf[gridIndices[v]] = (unsigned int)v;
+    }
+
+    ThreadPool& pool = ThreadPool::instance();
+    int quadRows = getQuadRowCount();
+    int grain = std::max(1, quadRows / pool.getChunkTarget());
+    pool.parallelFor(0, quadRows, grain, [&](int first, int last)
+    {
+        for(int q = first; q < last; ++q)
+            buildStackLines(q, vertexOf);
+    });
+}
+
+// lines of stack (cube: quad row) q, into its slice of lineIndices
+void Planet::buildStackLines(int q, const std::vector<unsigned int>& vertexOf) const
+{
+    std::size_t index, k, l;
+    getStackOffsets(q, index, k, l);
+    std::size_t base = getBaseVertex(q);
+    bool cube = topology == TOPOLOGY_CUBE;
+    int faceRow = cube ? q % faceSize : 0;
+    int count = cube ? faceSize : sectorCount;
+
+    if(!sharedVertices)
+    {
+        // sector j has its own vertices v1, v2, v3(, v4) from index on;
+        // the first stack needs only the vertical line
+        for(int j = 0; j < count; ++j)
+        {
+            unsigned short v = (unsigned short)(index - base);
+            lineIndices[l++] = v;
+            lineIndices[l++] = v+1;
+            if(cube || q != 0)
+            {
+                lineIndices[l++] = v;
+                lineIndices[l++] = v+2;
+            }
+
+            // the last quad of a face row closes the right edge and the
+            // last row of a face the bottom edge
+            if(cube && j == faceSize - 1)
+            {
+                lineIndices[l++] = v+2;
+                lineIndices[l++] = v+3;
+            }
+            if(cube && faceRow == faceSize - 1)
+            {
+                lineIndices[l++] = v+1;
+                lineIndices[l++] = v+3;
+            }
+            index += (cube || (q != 0 && q != stackCount - 1)) ? 4 : 3;
+        }
+        return;
+    }
+
+    //  k1--k1+1
+    //  |    |
+    //  k2--k2+1
+    std::size_t k1 = cube ? (std::size_t)(q / faceSize * (faceSize + 1) + faceRow) * (faceSize + 1)
+                          : (std::size_t)q * (sectorCount + 1);
+    std::size_t k2 = k1 + count + 1;
+    auto at = [&](std::size_t gridPoint) { return (unsigned short)(vertexOf[gridPoint] - base); };
+    for(int j = 0; j < count; ++j, ++k1, ++k2)
+    {
+        // vertical line for all stacks, horizontal below the first
+        lineIndices[l++] = at(k1);
+        lineIndices[l++] = at(k2);
+        if(cube || q != 0)
+        {
+            lineIndices[l++] = at(k1);
+            lineIndices[l++] = at(k1 + 1);
+        }
+        if(cube && j == faceSize - 1)
+        {
+            lineIndices[l++] = at(k1 + 1);
+            lineIndices[l++] = at(k2 + 1);
+        }
+        if(cube && faceRow == faceSize - 1)
+        {
+            lineIndices[l++] = at(k2);
+            lineIndices[l++] = at(k2 + 1);
+        }
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// line indices, built on first use; null once a GPU-only planet freed them
+///////////////////////////////////////////////////////////////////////////////
+const unsigned short* Planet::getLineIndices() const
+{
+    if(hasCachedCounts())
+        return cachedLineIndices;
+    if(lineIndices.empty() && !indices.empty())
+        buildLineIndices();
+    return lineIndices.data();
+}
+
+unsigned int Planet::getLineIndexCount() const
+{
+    if(hasCachedCounts())
+        return cachedLineIndexCount;
+    if(indices.empty())
+        return 0;
+    std::size_t vertex, index, lineIndex;
+    getStackOffsets(getQuadRowCount(), vertex, index, lineIndex);
+    return (unsigned int)lineIndex;
+}
+
+// whether the lines exist yet, so using them costs nothing
+bool Planet::hasLineIndices() const
+{
+    return hasCachedCounts() ? cachedLineIndices != 0 : !lineIndices.empty();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// one attribute of the interleaved stream as its own array, copied out (or
+// unpacked) on first use; null if the stream was freed after upload
+///////////////////////////////////////////////////////////////////////////////
+const float* Planet::extractStream(std::vector<float>& stream, int attribute) const
+{
+    const char* data = (const char*)getInterleavedData();
+    std::size_t count = getVertexCount();
+    std::size_t width = attribute == ATTRIB_COLOR ? 4 : 3;
+    if(!data || count == 0)
+        return 0;
+    if(stream.size() == count * width)
+        return stream.data();
+
+    stream.resize(count * width);
+    ThreadPool& pool = ThreadPool::instance();
+    int grain = std::max(1, (int)count / pool.getChunkTarget());
+    pool.parallelFor(0, (int)count, grain, [&](int first, int last)
+    {
+        for(int i = first; i < last; ++i)
+        {
+            float* out = &stream[(std::size_t)i * width];
+            if(packedVertices)
+            {
+                const PackedVertex& pv = ((const PackedVertex*)data)[i];
+                glm::vec4 a = attribute == ATTRIB_POSITION ? glm::unpackHalf4x16(pv.position) :
+                              attribute == ATTRIB_NORMAL ? glm::unpackSnorm4x8(pv.normal) :
+                                                           glm::unpackUnorm4x8(pv.color);
+                for(std::size_t c = 0; c < width; ++c)
+                    out[c] = a[(int)c];
+            }
+            else
+            {
+                const float* iv = (const float*)data + (std::size_t)i * 10 +
+                                  (attribute == ATTRIB_POSITION ? 0 : attribute == ATTRIB_NORMAL ? 3 : 6);
+                for(std::size_t c = 0; c < width; ++c)
+                    out[c] = iv[c];
+            }
+        }
+    });
+    return stream.data();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// dither value number draw at the point in unit direction u, one of
+// 0, 0.01, ..., 0.49, hashed from the seed and the point: the same point
+// always gets the same value, whatever thread colours it and in what order
+// the direction is rounded to 2^-20 first, so a point computed twice a few
+// ulps apart (on a cube seam, say) almost always gets the same value too
+///////////////////////////////////////////////////////////////////////////////
+static double getDither(uint64_t seed, const float u[3], uint64_t draw)
+{
+    // splitmix64 finalizer over seed, draw and the 3 rounded coordinates
+    uint64_t h = seed ^ (draw * 0x9E3779B97F4A7C15ULL);
+    for(int i = 0; i < 3; ++i)
+    {
+        h += (uint64_t)(uint32_t)(int32_t)lrintf(u[i] * 1048576.0f) + 0x9E3779B97F4A7C15ULL;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+    }
+    return (h >> 32) % 50 * 0.01;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// biome of a vertex aR from the centre in unit direction u, at latitude
+// the altitude falls in one of 4 bands (under water, beach, land, above the
+// snow line) and the latitude makes it temperate, arctic or arctic and frozen
+// over; biomeTable maps the two to the biome. Planet-wide switches move the
+// band limits instead of adding branches: without water there is no water
+// band or snow line, and only terrestrial planets have a beach
+///////////////////////////////////////////////////////////////////////////////
+unsigned char Planet::classifyVertex(float aR, const float u[3], float latitude) const
+{
+    float absLat = fabsf(latitude);
+    float localTemp = (temp + 45) - absLat * 180 / PI;  // get temperature at absLat
+    float coeff = 0.85 / 15 * localTemp;
+    if (coeff > 0.91) coeff = 0.91;                     // cap snow to still appear at lower latitudes
+    float minHeight = heightfield.getMinHeight(), dH = heightfield.getRange();
+    float snowHeight = (minHeight + coeff * dH) * K;    // snow is a function of temp + altitude
+    float waterHeight = (minHeight + water * dH) * K;
+    float sandHeight = waterHeight + (snowHeight - waterHeight) * 0.08;
+
+    bool wet = water > 0.0;
+    float waterLevel = wet ? radius + waterHeight : -HUGE_VALF;
+    float sandLevel = terrestrial ? radius + sandHeight : -HUGE_VALF;
+    float snowLevel = wet ? radius + snowHeight : HUGE_VALF;
+    int band = aR <= waterLevel ? 0 : aR < sandLevel ? 1 : aR > snowLevel ? 3 : 2;
+
+    // past the arctic circle the ice thins out towards it, dithered
+    int zone = 0;
+    double polar = absLat - (PI / 4 + temp * PI / 180);
+    if (wet && polar > 0 && getDither(getSeed(), u, 0) < sqrt(sqrt(polar)))
+        zone = band == 0 && getDither(getSeed(), u, 1) < pow(polar, 0.9) ? 2 : 1;
+
+    return biomeTable[terrestrial ? 0 : 1][zone][band];
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// RGBA of a biome at latitude, from the palette
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getBiomeColor(unsigned char biome, float latitude, float c[4]) const
+{
+    float shade = biome == BIOME_ROCK ? noise.noise1(latitude * 2) : 0.0f;
+    c[0] = palette[biome][0] + shade;
+    c[1] = palette[biome][1] + shade;
+    c[2] = palette[biome][2] + shade;
+    c[3] = 1.0f;
+}
+
+// colour of grid point g, as last classified; only rock needs the latitude
+void Planet::getGridColor(std::size_t g, float c[4]) const
+{
+    float u[3], latitude = 0;
+    int columns = getGridColumnCount();
+    if(biomes[g] == BIOME_ROCK)
+        getGridDirection((int)(g / columns), (int)(g % columns), u, latitude);
+    getBiomeColor(biomes[g], latitude, c);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// what the shader classifies a vertex from, each in [0, 1]: height within
+// the heightfield's range, latitude, and the 2 dither values of
+// classifyVertex() (doubled); float vertices only, as unorm8 would band the
+// height into coastlines 1/255 of the range apart
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getTerrainInputs(const float u[3], float latitude, float height, float c[4]) const
+{
+    float range = heightfield.getRange();
+    c[0] = range > 0 ? (height - heightfield.getMinHeight()) / range : 0.0f;
+    c[1] = latitude / PI + 0.5f;
+    c[2] = (float)getDither(getSeed(), u, 0) * 2;
+    c[3] = (float)getDither(getSeed(), u, 1) * 2;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// the parameters classifyVertex() uses, for a shader doing the same per pixel
+///////////////////////////////////////////////////////////////////////////////
+void Planet::getTerrainUniforms(TerrainUniforms& t) const
+{
+    t.radius = radius;
+    t.K = K;
+    t.water = water;
+    t.temp = temp;
+    t.minHeight = heightfield.getMinHeight();
+    t.range = heightfield.getRange();
+    t.oblateness = (float)getOblateness();
+    t.terrestrial = terrestrial;
+    memcpy(t.palette, palette, sizeof(palette));
+    memcpy(t.biomeTable, biomeTable[terrestrial ? 0 : 1], sizeof(t.biomeTable));
+    for(int i = 0; i < TERRAIN_SHADE_SAMPLES; ++i)
+    {
+        float latitude = PI * i / (TERRAIN_SHADE_SAMPLES - 1) - PI / 2;
+        t.rockShade[i] = noise.noise1(latitude * 2);    // as getBiomeColor() shades it
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// biome, and zone or band of the biome table, by the name the grammar gives it
+///////////////////////////////////////////////////////////////////////////////
+Biome getBiome(const std::string& name)
+{
+    for(int b = 0; b < BIOME_COUNT; ++b)
+    {
+        if(name == BIOME_NAMES[b])
+            return (Biome)b;
+    }
+    return BIOME_COUNT;
+}
+
+int getBiomeZone(const std::string& name)
+{
+    for(int z = 0; z < BIOME_ZONE_COUNT; ++z)
+    {
+        if(name == BIOME_ZONE_NAMES[z])
+            return z;
+    }
+    return -1;
+}
+
+int getBiomeBand(const std::string& name)
+{
+    for(int b = 0; b < BIOME_BAND_COUNT; ++b)
+    {
+        if(name == BIOME_BAND_NAMES[b])
+            return b;
+    }
+    return -1;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// compute face normal of a triangle v1-v2-v3
+// if a triangle has no surface (normal length = 0), then return a zero vector
+///////////////////////////////////////////////////////////////////////////////
+void Planet::computeFaceNormal(float x1, float y1, float z1,  // v1
+                               float x2, float y2, float z2,  // v2
+                               float x3, float y3, float z3,  // v3
+                               float normal[3]) const
+{
+    const float EPSILON = 0.000001f;
+
+    float nx, ny, nz;
+    normal[0] = normal[1] = normal[2] = 0.0f;   // default return value (0,0,0)
+
+    // find 2 edge vectors: v1-v2, v1-v3
+    float ex1 = x2 - x1;
+    float ey1 = y2 - y1;
+    float ez1 = z2 - z1;
+    float ex2 = x3 - x1;
+    float ey2 = y3 - y1;
+    float ez2 = z3 - z1;
+
+    // cross product: e1 x e2
+    nx = ey1 * ez2 - ez1 * ey2;
+    ny = ez1 * ex2 - ex1 * ez2;
+    nz = ex1 * ey2 - ey1 * ex2;
+
+    // normalize only if the length is > 0
+    float length = sqrtf(nx * nx + ny * ny + nz * nz);
+    if(length > EPSILON)
+    {
+        // normalize
+        float lengthInv = 1.0f / length;
+        normal[0] = nx * lengthInv;
+        normal[1] = ny * lengthInv;
+        normal[2] = nz * lengthInv;
+    }
 }
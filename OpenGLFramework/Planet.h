@@ -13,11 +13,108 @@
 #define GEOMETRY_Planet_H
 
 #include <vector>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <stdint.h>
+#include "Noise.h"
+#include "Heightfield.h"
+
+class MappedFile;
+struct HeightfieldHeader;
+struct MeshHeader;
+
+// terrain classes every vertex falls into; the palette gives their colours
+enum Biome
+{
+    BIOME_WATER,
+    BIOME_ICE,          // sea ice in arctic water
+    BIOME_SAND,         // the band just above the water line
+    BIOME_GRASS,        // land of a terrestrial planet
+    BIOME_ROCK,         // land of any other planet, shaded in bands by latitude
+    BIOME_SNOW,         // above the snow line, and arctic land
+    BIOME_COUNT
+};
+
+// biome by grammar name ("water", "ice", ...), BIOME_COUNT if there is none
+Biome getBiome(const std::string& name);
+
+// the axes of the biome table (see Params::biomeTable) by grammar name, -1 if
+// there is none: arctic zones "temperate", "arctic", "frozen" (over), and
+// altitude bands "sea" (under water), "beach", "land", "alpine" (above the
+// snow line)
+const int BIOME_ZONE_COUNT = 3;
+const int BIOME_BAND_COUNT = 4;
+int getBiomeZone(const std::string& name);
+int getBiomeBand(const std::string& name);
 
 struct Vertex
 {
     float x, y, z;
     float r = 1.0, g = 0.0, b = 0.0, a = 1.0;
+    float nx = 0.0, ny = 0.0, nz = 1.0;
+    unsigned char biome = BIOME_WATER;
+};
+
+// how the sphere is tessellated
+enum Topology
+{
+    TOPOLOGY_UV,        // stacks x sectors of latitude/longitude, dense at the poles
+    TOPOLOGY_CUBE       // six (sectors/4)^2 grids of a cube pushed out onto the sphere
+};
+
+// generation stages, in order; rerunning a stage reruns every stage after it
+enum Stage
+{
+    STAGE_NONE,         // nothing to regenerate
+    STAGE_PALETTE,      // look every vertex's biome up in the palette again
+    STAGE_COLOR,        // classify every vertex into a biome, then STAGE_PALETTE
+    STAGE_MESH,         // displace, shade and index the grid from the cached heightfield
+    STAGE_HEIGHTFIELD   // sample the noise at every grid point
+};
+
+// compact interleaved vertex, 16 bytes instead of 40
+// normals are snorm8 rather than 10:10:10:2 because fixed-function
+// glNormalPointer() cannot take the packed type on every driver
+struct PackedVertex
+{
+    uint64_t position;  // half x, y, z, 1
+    uint32_t normal;    // snorm8 x, y, z, 0
+    uint32_t color;     // unorm8 r, g, b, a
+};
+
+// a run of whole stacks (cube: quad rows) whose vertices span at most
+// MAX_SUBMESH_VERTICES, so its indices fit 16 bits relative to baseVertex
+// index ranges count unsigned shorts from the start of the index arrays
+struct SubMesh
+{
+    int firstRow;               // stacks/quad rows [firstRow, next sub-mesh's firstRow)
+    unsigned int baseVertex;    // added to every index of the sub-mesh
+    unsigned int vertexCount;
+    unsigned int firstIndex, indexCount;
+    unsigned int firstLineIndex, lineIndexCount;
+};
+
+// what a shader needs to classify the terrain per pixel like the planet does
+// per vertex (see Params::shaderClassification)
+const int TERRAIN_SHADE_SAMPLES = 64;
+struct TerrainUniforms
+{
+    float radius, K, water, temp;
+    float minHeight, range;             // of the heightfield the inputs are relative to
+    float oblateness;                   // added to the radius in x and y
+    bool terrestrial;
+    float palette[BIOME_COUNT][3];
+    unsigned char biomeTable[BIOME_ZONE_COUNT][BIOME_BAND_COUNT];  // Biome by [zone][band]
+    float rockShade[TERRAIN_SHADE_SAMPLES];     // added to rock, latitude -90 to 90 degrees
+};
+
+// generic vertex attribute locations of the interleaved stream, for shaders
+enum Attribute
+{
+    ATTRIB_POSITION = 0,
+    ATTRIB_NORMAL   = 1,
+    ATTRIB_COLOR    = 2
 };
 
 struct Params
@@ -25,7 +122,45 @@ struct Params
     double R = 6357000, M = 5.9722e24, D = 86164.0;
     float S = 0.1, T = 15.0, W = 0.57;
     bool terrestrial = true;
-    float red = 0.0, green = 0.0, blue = 0.0;
+    float palette[BIOME_COUNT][3] = {       // RGB of every Biome, 0-1
+        { 0.0, 94.0 / 255.0, 184.0 / 255.0 },               // water
+        { 180.0 / 255.0, 207.0 / 255.0, 250.0 / 255.0 },    // ice
+        { 0.761, 0.698, 0.502 },                            // sand
+        { 0.0, 154.0 / 255.0, 23.0 / 255.0 },               // grass
+        { 0.0, 0.0, 0.0 },                                  // rock, set by C
+        { 1.0, 0.98, 0.98 }                                 // snow
+    };
+    // Biome of every [land kind][arctic zone][altitude band], see
+    // getBiomeZone(); land kind 0 is terrestrial, 1 any other planet
+    unsigned char biomeTable[2][BIOME_ZONE_COUNT][BIOME_BAND_COUNT] = {
+        {
+            { BIOME_WATER, BIOME_SAND, BIOME_GRASS, BIOME_SNOW },
+            { BIOME_WATER, BIOME_SNOW, BIOME_SNOW,  BIOME_SNOW },
+            { BIOME_ICE,   BIOME_SNOW, BIOME_SNOW,  BIOME_SNOW }
+        },
+        {
+            { BIOME_WATER, BIOME_SAND, BIOME_ROCK,  BIOME_SNOW },
+            { BIOME_WATER, BIOME_SNOW, BIOME_SNOW,  BIOME_SNOW },
+            { BIOME_ICE,   BIOME_SNOW, BIOME_SNOW,  BIOME_SNOW }
+        }
+    };
+    uint64_t seed = 0;      // noise seed, same seed + grammar = same planet
+    int octaves = 6;        // fBm octaves, 0 = as many as the mesh resolution can show
+    float lacunarity = 2.0; // frequency multiplier between octaves
+    float gain = 0.5;       // amplitude multiplier between octaves
+    NoiseType noise = NOISE_PERLIN;
+    bool analyticNormals = true;    // vertex normals from the noise gradient, else per face
+    bool sharedVertices = true;     // one vertex per grid point, else one per triangle corner
+    bool packedVertices = false;    // interleave as PackedVertex instead of 10 floats
+    bool triangleStrips = false;    // shared layout only: one strip per stack instead of a list
+    bool gpuOnly = false;           // drop the CPU copies of the mesh once it is uploaded
+    bool shaderClassification = false;  // float vertices only: colours are terrain inputs classified per pixel
+    Topology topology = TOPOLOGY_UV;
+    float lodError = 0.0;   // chunked LOD screen-space error in pixels, 0 = one fixed mesh
+    int lodBudget = 256;    // MiB of LOD chunk meshes kept around
+    std::string cacheFile;  // heightfield cache, empty = always sample the noise
+    std::string meshCacheFile;  // mesh cache, empty = always build the mesh
+    uint64_t grammarHash = 0;   // hash of the grammar's noise tokens, stored in the caches
 };
 
 class Planet
@@ -34,43 +169,103 @@ public:
     // ctor/dtor
     Planet(Params params, float radius=1.0f, int sectorCount=36, int stackCount=18);
     Planet() {}
+    Planet(Planet&&) = default;             // moves hand the buffer objects over
+    Planet& operator=(Planet&&) = default;  // deletes the buffer objects of the planet replaced
     ~Planet() {}
 
     // getters/setters
     float getRadius() const                 { return radius; }
     int getSectorCount() const              { return sectorCount; }
     int getStackCount() const               { return stackCount; }
+    Topology getTopology() const            { return topology; }
+    int getFaceSize() const                 { return faceSize; }    // quads along a cube face edge
+    uint64_t getSeed() const                { return noiseTables->getSeed(); }
+    int getOctaveCount() const;
+    int getOctaveCount(float spacing) const;    // auto count for vertices spacing radians apart
+    float getRelief() const;                // max distance of the surface from the radius
+    const NoiseBackend& getNoise() const;   // terrain noise backend
     void set(float radius, int sectorCount, int stackCount);
     void setRadius(float radius);
     void setSectorCount(int sectorCount);
     void setStackCount(int stackCount);
-    void setTexture(int, int);
+    void setTexture(int rows, int columns);
+    Stage setParams(const Params& params);      // regenerate only what params invalidate
+    Stage getInvalidatedStage(const Params& params) const;
+
+    // with shader classification the colour of every vertex (and of the LOD
+    // chunks) is its terrain inputs instead, see getTerrainInputs(), and a
+    // shader colours and lights them with these uniforms; water, temperature
+    // and palette changes then only change the uniforms
+    bool isShaderClassified() const         { return shaderClassification; }
+    void getTerrainUniforms(TerrainUniforms& uniforms) const;
+
+    // surface at arbitrary directions, for LOD chunks
+    void buildSurface(const float* directions, int count, int octaveCount, Vertex* out) const;
+    static void getCubeDirection(int face, float a, float b, float u[3]);  // a, b in [-1, 1]
 
     // for vertex data
-    unsigned int getVertexCount() const     { return (unsigned int)vertices.size() / 3; }
-    unsigned int getNormalCount() const     { return (unsigned int)normals.size() / 3; }
-    unsigned int getColorCount() const      { return (unsigned int)colors.size() / 4; }
-    unsigned int getIndexCount() const      { return (unsigned int)indices.size(); }
-    unsigned int getLineIndexCount() const  { return (unsigned int)lineIndices.size(); }
-    unsigned int getTriangleCount() const   { return getIndexCount() / 3; }
-    unsigned int getVertexSize() const      { return (unsigned int)vertices.size() * sizeof(float); }
-    unsigned int getNormalSize() const      { return (unsigned int)normals.size() * sizeof(float); }
-    unsigned int getColorSize() const       { return (unsigned int)colors.size() * sizeof(float); }
-    unsigned int getIndexSize() const       { return (unsigned int)indices.size() * sizeof(unsigned int); }
-    unsigned int getLineIndexSize() const   { return (unsigned int)lineIndices.size() * sizeof(unsigned int); }
-    const float* getVertices() const        { return vertices.data(); }
-    const float* getNormals() const         { return normals.data(); }
-    const float* getColors() const          { return colors.data(); }
-    const unsigned int* getIndices() const  { return indices.data(); }
-    const unsigned int* getLineIndices() const  { return lineIndices.data(); }
-
-    // for interleaved vertices: V/N/T
+    // only the interleaved stream and the triangle indices are built with
+    // the mesh; the separate streams are copied (or unpacked, at the packed
+    // precision) out of the interleaved one on first use, and the line
+    // indices are built on first use too, so not on the same planet from
+    // several threads at once
+    // once a GPU-only planet is uploaded no stream exists, only their counts
+    unsigned int getVertexCount() const     { return hasCachedCounts() ? cachedVertexCount : (unsigned int)(packedVertices ? packedStream.size() : interleavedVertices.size() / 10); }
+    unsigned int getNormalCount() const     { return getVertexCount(); }
+    unsigned int getColorCount() const      { return getVertexCount(); }
+    unsigned int getIndexCount() const      { return hasCachedCounts() ? cachedIndexCount : (unsigned int)indices.size(); }
+    unsigned int getLineIndexCount() const;
+    unsigned int getTriangleCount() const;
+    unsigned int getVertexSize() const      { return getVertexCount() * 3 * sizeof(float); }
+    unsigned int getNormalSize() const      { return getNormalCount() * 3 * sizeof(float); }
+    unsigned int getColorSize() const       { return getColorCount() * 4 * sizeof(float); }
+    unsigned int getIndexSize() const       { return getIndexCount() * sizeof(unsigned short); }
+    unsigned int getLineIndexSize() const   { return getLineIndexCount() * sizeof(unsigned short); }
+    const float* getVertices() const        { return extractStream(vertices, ATTRIB_POSITION); }
+    const float* getNormals() const         { return extractStream(normals, ATTRIB_NORMAL); }
+    const float* getColors() const          { return extractStream(colors, ATTRIB_COLOR); }
+    const unsigned short* getIndices() const        { return hasCachedCounts() ? cachedIndices : indices.data(); }
+    const unsigned short* getLineIndices() const;
+
+    // indices are 16 bits, relative to the base vertex of their sub-mesh;
+    // with triangle strips each stack is one strip ending in 0xffff
+    unsigned int getSubMeshCount() const            { return (unsigned int)subMeshes.size(); }
+    const SubMesh* getSubMeshes() const             { return subMeshes.data(); }
+
+    // post-transform cache efficiency of the triangle order: misses per
+    // triangle (ACMR) and per vertex (ATVR)
+    void getCacheStats(float& acmr, float& atvr) const;
+
+    // for interleaved vertices: V/N/C, as 10 floats or one PackedVertex each
     unsigned int getInterleavedVertexCount() const  { return getVertexCount(); }    // # of vertices
-    unsigned int getInterleavedVertexSize() const   { return (unsigned int)interleavedVertices.size() * sizeof(float); }    // # of bytes
-    int getInterleavedStride() const                { return interleavedStride; }   // should be 32 bytes
-    const float* getInterleavedVertices() const     { return interleavedVertices.data(); }
+    unsigned int getInterleavedVertexSize() const   { return getVertexCount() * interleavedStride; }    // # of bytes
+    int getInterleavedStride() const                { return interleavedStride; }   // 40 bytes, 16 packed
+    bool isPacked() const                           { return packedVertices; }
+    const void* getInterleavedData() const          { return hasCachedCounts() ? (const void*)cachedInterleaved :
+                                                             packedVertices ? (const void*)packedStream.data() :
+                                                                              (const void*)interleavedVertices.data(); }
+    const float* getInterleavedVertices() const     { return packedVertices ? 0 : (const float*)getInterleavedData(); }
+    const PackedVertex* getPackedVertices() const   { return packedVertices ? (const PackedVertex*)getInterleavedData() : 0; }
+
+    // GPU-resident mode: upload() copies the mesh into buffer objects and
+    // draw() uses them from then on; calling it again only uploads what was
+    // regenerated since, so it is cheap to call every frame
+    // a GPU-only planet frees its CPU copies of the mesh after uploading;
+    // the heightfield stays, so releasing the buffers rebuilds them
+    // both need a current GL context with buffer objects (GL 1.5), as does
+    // assigning over an uploaded planet; the dtor leaves the buffers alone
+    void upload();
+    void releaseBuffers();                              // back to client arrays
+    bool isUploaded() const                 { return buffers.vbo != 0; }
+    bool isGpuOnly() const                  { return gpuOnly; }
+    bool hasClientCopy() const              { return !streamsReleased; }
+
+    // point the fixed-function arrays and the shader attributes at an
+    // interleaved V/N/C stream: memory, or an offset into the bound buffer
+    static void enableArrays(const void* base, int stride, bool packed=false);
+    static void disableArrays();
 
-    // draw in VertexArray mode
+    // draw in VertexArray mode, or from the buffer objects once uploaded
     void draw() const;                                  // draw surface
     void drawLines(const float lineColor[4]) const;     // draw lines only
     void drawWithLines(const float lineColor[4]) const; // draw surface and lines
@@ -82,32 +277,84 @@ protected:
 
 private:
     // member functions
+    void copyParams(const Params& params);
+    bool loadTexture(int rows, int columns);
+    bool saveTexture(int rows, int columns);
+    void fillHeader(HeightfieldHeader& header, int rows, int columns) const;
+    bool loadMesh(int rows, int columns);
+    bool saveMesh(int rows, int columns);
+    void fillHeader(MeshHeader& header, int rows, int columns) const;
     void buildVertices();
-    Vertex colorVertex(char c, float aR, float latitude, float vec[3]);
-    void buildInterleavedVertices();
+    void releaseStreams();
     void clearArrays();
-    void addVertex(float x, float y, float z);
-    void addNormal(float x, float y, float z);
-    void addColor(float r, float g, float b, float a);
-    void addIndices(unsigned int i1, unsigned int i2, unsigned int i3);
-    std::vector<float> computeFaceNormal(float x1, float y1, float z1,
-                                         float x2, float y2, float z2,
-                                         float x3, float y3, float z3);
+    void restoreStreams();
+    bool hasCachedCounts() const            { return meshFile || streamsReleased; }
+    void buildColors(bool classify);
+    int getGridRowCount() const;
+    int getGridColumnCount() const;
+    int getQuadRowCount() const;
+    void getGridDirection(int row, int column, float u[3], float& latitude) const;
+    void buildGridRow(int stack, Vertex* row) const;
+    double getOblateness() const;
+    Vertex displaceVertex(const float u[3], float latitude, float height, const float* slope) const;
+    void buildSeparateVertices(const std::vector<Vertex>& gridVertices, int firstStack, int lastStack);
+    void buildSeparateQuads(const std::vector<Vertex>& gridVertices, int firstRow, int lastRow);
+    void buildSharedVertices();
+    void buildSharedIndices(int stack);
+    void buildSharedQuadIndices(int quadRow);
+    void buildLineIndices() const;
+    void buildStackLines(int stack, const std::vector<unsigned int>& vertexOf) const;
+    bool hasLineIndices() const;
+    const float* extractStream(std::vector<float>& stream, int attribute) const;
+    void getStackOffsets(int stack, std::size_t& vertex, std::size_t& index, std::size_t& lineIndex) const;
+    void getStackVertexRange(int stack, std::size_t& first, std::size_t& last) const;
+    void buildSubMeshes();
+    unsigned int getBaseVertex(int stack) const;
+    void drawSubMeshes(bool lines, const char* vertexBase, const char* indexBase) const;
+    void optimizeMesh();
+    std::size_t buildStrip(std::size_t index, unsigned short row1, unsigned short row2);
+    void optimizeSubMesh(int subMesh);
+    void resizeArrays(std::size_t vertexCount, std::size_t indexCount);
+    void setVertex(std::size_t i, const Vertex& v, std::size_t gridIndex, const float* faceNormal);
+    void setInterleavedNormal(std::size_t i, const float n[3]);
+    void setInterleavedColor(std::size_t i, const float c[4]);
+    unsigned char classifyVertex(float aR, const float u[3], float latitude) const;
+    void getBiomeColor(unsigned char biome, float latitude, float c[4]) const;
+    void getGridColor(std::size_t gridIndex, float c[4]) const;
+    void getTerrainInputs(const float u[3], float latitude, float height, float c[4]) const;
+    void bindBuffers() const;
+    void computeFaceNormal(float x1, float y1, float z1,
+                           float x2, float y2, float z2,
+                           float x3, float y3, float z3,
+                           float normal[3]) const;
 
     // member vars
     float radius;
     int sectorCount;                        // longitude, # of slices
     int stackCount;                         // latitude, # of stacks
-    std::vector<float> vertices;
-    std::vector<float> normals;
-    std::vector<float> colors;
-    std::vector<unsigned int> indices;
-    std::vector<unsigned int> lineIndices;
-    float** tex;
-    float minHeight = 0.0;
-    float maxHeight = 0.0;
-    float dH;
+    Topology topology;
+    int faceSize;                           // cube: quads along a face edge
+    mutable std::vector<float> vertices;    // taken from the interleaved stream on first use
+    mutable std::vector<float> normals;
+    mutable std::vector<float> colors;
+    std::vector<unsigned short> indices;    // relative to their sub-mesh's base vertex
+    mutable std::vector<unsigned short> lineIndices;    // built on first use
+    std::vector<SubMesh> subMeshes;
+    std::vector<unsigned int> gridIndices;  // grid point each vertex came from
+    std::vector<unsigned char> biomes;      // Biome of every grid point, as last classified; until uploaded
+    std::shared_ptr<const NoiseTables> noiseTables = std::make_shared<NoiseTables>();  // seeded once, shared by both
+    NoiseContext noise{noiseTables};        // perlin, also shades non-terrestrial colour
+    SimplexNoise simplex{noiseTables};
+    NoiseType noiseType;
+    Heightfield heightfield;                // heights and slopes over the unit sphere, per grid point
+    std::string cacheFile;
+    uint64_t grammarHash;
+    bool analyticNormals;
+    bool sharedVertices;
     float res = 2.0;
+    int octaves;                            // 0 = auto
+    float lacunarity;
+    float gain;
 
     float PI = acos(-1);
     double dPI = acos(-1);
@@ -121,11 +368,53 @@ private:
     float K;
     float temp;
     bool terrestrial;
-    float red, green, blue;
+    float palette[BIOME_COUNT][3];
+    unsigned char biomeTable[2][BIOME_ZONE_COUNT][BIOME_BAND_COUNT];
+    bool shaderClassification = false;
 
     // interleaved
     std::vector<float> interleavedVertices;
-    int interleavedStride;                  // # of bytes to hop to the next vertex (should be 32 bytes)
+    std::vector<PackedVertex> packedStream; // used instead when packedVertices is set
+    bool packedVertices;
+    bool triangleStrips;                    // indices are strips cut by restart indices
+    int interleavedStride;                  // # of bytes to hop to the next vertex (40, or 16 packed)
+
+    // the streams are freed after upload() if gpuOnly is set; the counts
+    // are then kept in cachedVertexCount etc. and the pointers are null
+    bool gpuOnly = false;
+    bool streamsReleased = false;
+
+    // mesh cache the streams are mapped from instead of the vectors, if any
+    std::shared_ptr<MappedFile> meshFile;
+    std::string meshCacheFile;
+    const char* cachedInterleaved;
+    const unsigned short* cachedIndices;
+    const unsigned short* cachedLineIndices;
+    unsigned int cachedVertexCount;
+    unsigned int cachedIndexCount;
+    unsigned int cachedLineIndexCount;
+
+    // buffer objects, 0 until upload()
+    // only one planet owns the names: moving takes them from the source,
+    // and a planet moved over deletes its own first
+    struct BufferObjects
+    {
+        unsigned int vao = 0;               // 0 if vertex array objects are not supported
+        unsigned int vbo = 0;
+        unsigned int ibo = 0;
+        unsigned int lineIbo = 0;
+        std::size_t vboSize = 0;            // bytes allocated for each
+        std::size_t iboSize = 0;
+        std::size_t lineIboSize = 0;
+
+        BufferObjects() {}
+        BufferObjects(BufferObjects&& other)                { take(other); }
+        BufferObjects& operator=(BufferObjects&& other)     { if(this != &other) { release(); take(other); } return *this; }
+        void take(BufferObjects& other);
+        void release();                     // needs the GL context
+    };
+    BufferObjects buffers;
+    Stage uploadStage = STAGE_MESH;         // what changed since the last upload
 
 };
 
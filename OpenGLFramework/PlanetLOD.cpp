@@ -0,0 +1,455 @@
+///////////////////////////////////////////////////////////////////////////////
+// PlanetLOD.cpp
+// =============
+// Chunked quadtree level of detail for a Planet.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+#define NOMINMAX        // keep std::min/std::max usable
+#include <windows.h>    // include windows.h to avoid thousands of compile errors even though this class is not depending on Windows
+#endif
+
+#ifdef __APPLE__
+#include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <utility>
+#include "PlanetLOD.h"
+#include "ThreadPool.h"
+
+
+
+// constants //////////////////////////////////////////////////////////////////
+const int MAX_LEVEL = 16;                   // deeper than this float positions run out of precision
+const int MAX_CHUNKS_PER_UPDATE = 32;       // refinement work per frame
+const float RELIEF_MARGIN = 1.25f;          // finer octaves add some height over the base planet's
+const float SKIRT_DEPTH = 4.0f;             // in grid spacings
+const float PI = 3.14159265f;
+const int MAX_CHUNK_SIZE = 250;             // grid plus skirts stay within 16-bit indices
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// k-th grid vertex along edge e of an n x n chunk grid: top, bottom, left, right
+///////////////////////////////////////////////////////////////////////////////
+static int edgeVertex(int edge, int k, int n)
+{
+    switch(edge)
+    {
+    case 0:  return k;                      // top row
+    case 1:  return (n - 1) * n + k;        // bottom row
+    case 2:  return k * n;                  // left column
+    default: return k * n + n - 1;          // right column
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ctor: the six face roots are generated up front and never evicted
+///////////////////////////////////////////////////////////////////////////////
+PlanetLOD::PlanetLOD(const Planet& planet, int chunkSize, float pixelError, std::size_t memoryBudget)
+    : planet(planet), chunkSize(std::min(std::max(1, chunkSize), MAX_CHUNK_SIZE)), pixelError(pixelError), memoryBudget(memoryBudget),
+      eyeDistance(0), viewConeAngle(PI), pixelsPerRadian(0), frame(0), residentCount(0), residentSize(0), maxLevel(0)
+{
+    relief = planet.getRelief() * RELIEF_MARGIN;
+    eye[0] = eye[1] = eye[2] = 0;
+
+    buildIndices();
+
+    for(int f = 0; f < 6; ++f)
+        roots[f].reset(createNode(f, 0, -1.0f, -1.0f, 2.0f));
+
+    ThreadPool::instance().parallelFor(0, 6, 1, [this](int first, int last)
+    {
+        for(int f = first; f < last; ++f)
+            buildChunk(*roots[f]);
+    });
+    for(int f = 0; f < 6; ++f)
+    {
+        residentSize += roots[f]->vertices.size() * sizeof(float);
+        ++residentCount;
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// node over [a, a+size] x [b, b+size] of a cube face, with its bounds
+///////////////////////////////////////////////////////////////////////////////
+PlanetLOD::Node* PlanetLOD::createNode(int face, int level, float a, float b, float size) const
+{
+    Node* node = new Node;
+    node->face = face;
+    node->level = level;
+    node->a = a;
+    node->b = b;
+    node->size = size;
+    node->lastUsed = 0;
+
+    float dir[3], corner[3];
+    Planet::getCubeDirection(face, a + size / 2, b + size / 2, dir);
+
+    // face coords are angles, so the corners are the farthest points
+    float minCos = 1.0f;
+    for(int k = 0; k < 4; ++k)
+    {
+        Planet::getCubeDirection(face, a + size * (k & 1), b + size * (k >> 1), corner);
+        minCos = std::min(minCos, dir[0] * corner[0] + dir[1] * corner[1] + dir[2] * corner[2]);
+    }
+
+    float radius = planet.getRadius();
+    node->coneAngle = acosf(std::max(-1.0f, std::min(1.0f, minCos)));
+    node->boundRadius = 2 * radius * sinf(node->coneAngle / 2) + relief;
+    for(int k = 0; k < 3; ++k)
+        node->center[k] = dir[k] * radius;
+
+    // a unit of face coords spans 45 degrees
+    node->error = size * PI / 4 / chunkSize * radius;
+    return node;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// triangle indices shared by all chunks: the grid, then the skirts
+// skirt quads are emitted with both windings so they show from either side
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::buildIndices()
+{
+    int n = chunkSize + 1;
+    indices.clear();
+    indices.reserve((std::size_t)chunkSize * chunkSize * 6 + 4 * chunkSize * 12);
+
+    //  k1--k1+1
+    //  |  / |
+    //  k2--k2+1
+    for(int i = 0; i < chunkSize; ++i)
+    {
+        unsigned short k1 = i * n;
+        unsigned short k2 = k1 + n;
+        for(int j = 0; j < chunkSize; ++j, ++k1, ++k2)
+        {
+            indices.push_back(k1);
+            indices.push_back(k2);
+            indices.push_back(k1 + 1);
+            indices.push_back(k1 + 1);
+            indices.push_back(k2);
+            indices.push_back(k2 + 1);
+        }
+    }
+
+    // skirt vertices follow the grid, n per edge
+    for(int e = 0; e < 4; ++e)
+    {
+        unsigned short s = n * n + e * n;
+        for(int k = 0; k < chunkSize; ++k)
+        {
+            unsigned short e1 = edgeVertex(e, k, n), e2 = edgeVertex(e, k + 1, n);
+            unsigned short s1 = s + k, s2 = s + k + 1;
+            unsigned short quad[12] = { e1, s1, e2,  e2, s1, s2,      // one side
+                                      e1, e2, s1,  e2, s2, s1 };    // other side
+            indices.insert(indices.end(), quad, quad + 12);
+        }
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// generate the interleaved vertices of a chunk
+// octaves are added down to the chunk's own vertex spacing, so deeper chunks
+// carry finer terrain than the base planet mesh
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::buildChunk(Node& node) const
+{
+    int n = chunkSize + 1;
+    std::vector<float> directions((std::size_t)n * n * 3);
+    for(int i = 0; i < n; ++i)
+    {
+        for(int j = 0; j < n; ++j)
+        {
+            Planet::getCubeDirection(node.face, node.a + node.size * j / chunkSize,
+                                     node.b + node.size * i / chunkSize, &directions[(i * n + j) * 3]);
+        }
+    }
+
+    int octaves = std::max(planet.getOctaveCount(), planet.getOctaveCount(node.error / planet.getRadius()));
+    std::vector<Vertex> surface((std::size_t)n * n);
+    planet.buildSurface(directions.data(), n * n, octaves, surface.data());
+
+    node.vertices.resize((std::size_t)(n * n + 4 * n) * 10);
+
+    // skirts hang straight down from the edge vertices
+    float skirtScale = 1.0f - SKIRT_DEPTH * node.error / planet.getRadius();
+    for(int k = 0; k < n * n + 4 * n; ++k)
+    {
+        bool skirt = k >= n * n;
+        const Vertex& v = skirt ? surface[edgeVertex((k - n * n) / n, (k - n * n) % n, n)] : surface[k];
+        float scale = skirt ? skirtScale : 1.0f;
+
+        float* dst = &node.vertices[(std::size_t)k * 10];
+        dst[0] = v.x * scale;  dst[1] = v.y * scale;  dst[2] = v.z * scale;
+        dst[3] = v.nx;         dst[4] = v.ny;         dst[5] = v.nz;
+        dst[6] = v.r;          dst[7] = v.g;          dst[8] = v.b;          dst[9] = v.a;
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// screen-space error of a node: its vertex spacing in pixels at the closest
+// point of its bounding sphere
+///////////////////////////////////////////////////////////////////////////////
+float PlanetLOD::getProjectedError(const Node& node) const
+{
+    float dx = node.center[0] - eye[0];
+    float dy = node.center[1] - eye[1];
+    float dz = node.center[2] - eye[2];
+    float distance = sqrtf(dx * dx + dy * dy + dz * dz) - node.boundRadius;
+    distance = std::max(distance, node.error * 0.001f);
+    return node.error / distance * pixelsPerRadian;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// a node is culled if it is behind the horizon or outside the view cone
+// around the line of sight (the camera always looks at the planet centre)
+///////////////////////////////////////////////////////////////////////////////
+bool PlanetLOD::isCulled(const Node& node) const
+{
+    float radius = planet.getRadius();
+    float rLow = std::max(radius - relief, radius * 0.5f);
+    float rHigh = radius + relief;
+
+    // the eye sees the sphere of radius rLow up to acos(rLow / d) away from
+    // its own direction, and peaks up to rHigh a bit beyond that
+    if(eyeDistance > rLow)
+    {
+        float horizon = acosf(rLow / eyeDistance) + acosf(rLow / rHigh) + node.coneAngle;
+        float cosAngle = (eye[0] * node.center[0] + eye[1] * node.center[1] + eye[2] * node.center[2]) / (eyeDistance * radius);
+        if(horizon < PI && cosAngle < cosf(horizon))
+            return true;
+    }
+
+    float dx = node.center[0] - eye[0];
+    float dy = node.center[1] - eye[1];
+    float dz = node.center[2] - eye[2];
+    float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+    if(distance <= node.boundRadius || eyeDistance <= 0)
+        return false;
+
+    float cosAngle = -(dx * eye[0] + dy * eye[1] + dz * eye[2]) / (distance * eyeDistance);
+    float angle = acosf(std::max(-1.0f, std::min(1.0f, cosAngle)));
+    return angle - asinf(node.boundRadius / distance) > viewConeAngle;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// walk the tree: split nodes whose error is too large once all their visible
+// children have meshes, queue the missing ones, and draw the rest
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::select(Node& node)
+{
+    if(isCulled(node))
+        return;
+
+    if(node.level < MAX_LEVEL && getProjectedError(node) > pixelError)
+    {
+        if(!node.children[0])
+        {
+            float half = node.size / 2;
+            for(int k = 0; k < 4; ++k)
+                node.children[k].reset(createNode(node.face, node.level + 1, node.a + half * (k & 1), node.b + half * (k >> 1), half));
+        }
+
+        bool ready = true;
+        for(int k = 0; k < 4; ++k)
+        {
+            Node& child = *node.children[k];
+            if(child.vertices.empty() && !isCulled(child))
+            {
+                pending.push_back(&child);
+                ready = false;
+            }
+        }
+
+        if(ready)
+        {
+            for(int k = 0; k < 4; ++k)
+                select(*node.children[k]);
+            return;
+        }
+    }
+    else
+    {
+        prune(node);
+    }
+
+    // the node itself is drawn; an evicted mesh has to come back right away
+    if(node.vertices.empty())
+    {
+        buildChunk(node);
+        residentSize += node.vertices.size() * sizeof(float);
+        ++residentCount;
+    }
+    node.lastUsed = frame;
+    drawList.push_back(&node);
+    maxLevel = std::max(maxLevel, node.level);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// drop children whose subtrees hold no chunk meshes
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::prune(Node& node)
+{
+    if(!node.children[0])
+        return;
+
+    bool empty = true;
+    for(int k = 0; k < 4; ++k)
+    {
+        prune(*node.children[k]);
+        if(!node.children[k]->vertices.empty() || node.children[k]->children[0])
+            empty = false;
+    }
+
+    if(empty)
+    {
+        for(int k = 0; k < 4; ++k)
+            node.children[k].reset();
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// choose this frame's chunks
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::update(const float eye[3], float fovY, float aspect, int screenHeight)
+{
+    ++frame;
+    for(int k = 0; k < 3; ++k)
+        this->eye[k] = eye[k];
+    eyeDistance = sqrtf(eye[0] * eye[0] + eye[1] * eye[1] + eye[2] * eye[2]);
+
+    float tanHalf = tanf(fovY * PI / 360);
+    viewConeAngle = atanf(tanHalf * sqrtf(1 + aspect * aspect));
+    pixelsPerRadian = screenHeight / (2 * tanHalf);
+
+    drawList.clear();
+    pending.clear();
+    maxLevel = 0;
+    for(int f = 0; f < 6; ++f)
+        select(*roots[f]);
+
+    // refine where it is most needed first, a bounded amount per update
+    std::vector<std::pair<float, Node*> > wanted;
+    wanted.reserve(pending.size());
+    for(std::size_t k = 0; k < pending.size(); ++k)
+        wanted.push_back(std::make_pair(getProjectedError(*pending[k]), pending[k]));
+    std::sort(wanted.begin(), wanted.end(),
+              [](const std::pair<float, Node*>& x, const std::pair<float, Node*>& y) { return x.first > y.first; });
+    if(wanted.size() > MAX_CHUNKS_PER_UPDATE)
+        wanted.resize(MAX_CHUNKS_PER_UPDATE);
+
+    ThreadPool::instance().parallelFor(0, (int)wanted.size(), 1, [&](int first, int last)
+    {
+        for(int k = first; k < last; ++k)
+            buildChunk(*wanted[k].second);
+    });
+    for(std::size_t k = 0; k < wanted.size(); ++k)
+    {
+        wanted[k].second->lastUsed = frame;     // wanted now, so not the first to go
+        residentSize += wanted[k].second->vertices.size() * sizeof(float);
+        ++residentCount;
+    }
+
+    evict();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// free the least recently drawn chunks until the budget is met
+// roots and chunks drawn this frame are kept
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::collectResident(Node& node, std::vector<Node*>& resident)
+{
+    if(node.level > 0 && !node.vertices.empty() && node.lastUsed != frame)
+        resident.push_back(&node);
+    if(node.children[0])
+    {
+        for(int k = 0; k < 4; ++k)
+            collectResident(*node.children[k], resident);
+    }
+}
+
+void PlanetLOD::evict()
+{
+    if(residentSize <= memoryBudget)
+        return;
+
+    std::vector<Node*> resident;
+    for(int f = 0; f < 6; ++f)
+        collectResident(*roots[f], resident);
+
+    // oldest first, the finest of equally old ones first
+    std::sort(resident.begin(), resident.end(), [](const Node* x, const Node* y)
+    {
+        return x->lastUsed != y->lastUsed ? x->lastUsed < y->lastUsed : x->level > y->level;
+    });
+
+    for(std::size_t k = 0; k < resident.size() && residentSize > memoryBudget; ++k)
+    {
+        residentSize -= resident[k]->vertices.size() * sizeof(float);
+        --residentCount;
+        std::vector<float>().swap(resident[k]->vertices);
+    }
+
+    for(int f = 0; f < 6; ++f)
+        prune(*roots[f]);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// draw the chunks chosen by the last update
+// OpenGL RC must be set before calling it
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::draw() const
+{
+    for(std::size_t k = 0; k < drawList.size(); ++k)
+    {
+        Planet::enableArrays(drawList[k]->vertices.data(), 40);
+        glDrawElements(GL_TRIANGLES, (unsigned int)indices.size(), GL_UNSIGNED_SHORT, indices.data());
+    }
+    Planet::disableArrays();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// print itself
+///////////////////////////////////////////////////////////////////////////////
+void PlanetLOD::printSelf() const
+{
+    std::cout << "===== Planet LOD =====\n"
+              << "      Chunk Size: " << chunkSize << "\n"
+              << "     Pixel Error: " << pixelError << "\n"
+              << "   Memory Budget: " << memoryBudget / (1 << 20) << " MiB\n"
+              << "    Drawn Chunks: " << getDrawnChunkCount() << "\n"
+              << "  Triangle Count: " << getTriangleCount() << "\n"
+              << "       Max Level: " << maxLevel << "\n"
+              << " Resident Chunks: " << residentCount << "\n"
+              << "   Resident Size: " << residentSize / (1 << 20) << " MiB" << std::endl;
+}
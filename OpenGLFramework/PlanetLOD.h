@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+// PlanetLOD.h
+// ===========
+// Chunked quadtree level of detail for a Planet.
+// Each cube face is the root of a quadtree; every node is a fixed grid of
+// chunkSize x chunkSize quads over its patch of the face. Nodes split while
+// their grid spacing projects to more than pixelError pixels on screen and
+// merge back when it does not. Chunk meshes are generated on demand and the
+// least recently drawn ones are evicted once memoryBudget bytes are in use.
+// Chunks carry skirts along their edges to hide cracks between levels.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef GEOMETRY_PlanetLOD_H
+#define GEOMETRY_PlanetLOD_H
+
+#include <vector>
+#include <memory>
+#include "Planet.h"
+
+class PlanetLOD
+{
+public:
+    // ctor/dtor
+    PlanetLOD(const Planet& planet, int chunkSize=32, float pixelError=4.0f, std::size_t memoryBudget=256 << 20);
+    ~PlanetLOD() {}
+
+    // pick the chunks to draw for a camera at eye (planet space) looking at
+    // the planet centre, generating missing chunks and evicting old ones
+    // fovY is in degrees, as for gluPerspective()
+    void update(const float eye[3], float fovY, float aspect, int screenHeight);
+
+    // getters/setters
+    int getChunkSize() const                    { return chunkSize; }
+    float getPixelError() const                 { return pixelError; }
+    std::size_t getMemoryBudget() const         { return memoryBudget; }
+    void setPixelError(float error)             { pixelError = error; }
+    void setMemoryBudget(std::size_t bytes)     { memoryBudget = bytes; }
+
+    // stats of the last update
+    unsigned int getDrawnChunkCount() const     { return (unsigned int)drawList.size(); }
+    unsigned int getTriangleCount() const       { return getDrawnChunkCount() * (unsigned int)(indices.size() / 3); }
+    unsigned int getResidentChunkCount() const  { return residentCount; }
+    std::size_t getResidentSize() const         { return residentSize; }
+    int getMaxLevel() const                     { return maxLevel; }
+
+    // draw the chosen chunks in VertexArray mode
+    void draw() const;
+
+    // debug
+    void printSelf() const;
+
+private:
+    struct Node
+    {
+        int face, level;
+        float a, b, size;                   // top-left corner and edge length in face coords
+        float center[3];                    // bounding sphere
+        float boundRadius;
+        float coneAngle;                    // angle from the centre direction to the corners
+        float error;                        // surface distance between grid vertices
+        std::vector<float> vertices;        // interleaved V/N/C, empty until generated
+        unsigned int lastUsed;              // frame this chunk was last drawn
+        std::unique_ptr<Node> children[4];
+    };
+
+    PlanetLOD(const PlanetLOD&);            // not copyable
+    PlanetLOD& operator=(const PlanetLOD&);
+
+    // member functions
+    Node* createNode(int face, int level, float a, float b, float size) const;
+    void buildIndices();
+    void buildChunk(Node& node) const;
+    void select(Node& node);
+    bool isCulled(const Node& node) const;
+    float getProjectedError(const Node& node) const;
+    void prune(Node& node);
+    void collectResident(Node& node, std::vector<Node*>& resident);
+    void evict();
+
+    // member vars
+    const Planet& planet;
+    int chunkSize;                          // # of quads along a chunk edge
+    float pixelError;                       // max screen-space error in pixels
+    std::size_t memoryBudget;               // bytes of chunk vertices to keep
+    std::unique_ptr<Node> roots[6];
+    std::vector<unsigned short> indices;    // shared by every chunk, skirts included
+    float relief;                           // max terrain height above/below the radius
+
+    // camera of the current update
+    float eye[3];
+    float eyeDistance;
+    float viewConeAngle;
+    float pixelsPerRadian;                  // screen height / view angle, roughly
+
+    // frame state
+    unsigned int frame;
+    std::vector<Node*> drawList;
+    std::vector<Node*> pending;             // children wanted for a split, not generated yet
+    unsigned int residentCount;
+    std::size_t residentSize;
+    int maxLevel;
+};
+
+#endif
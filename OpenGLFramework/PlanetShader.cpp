@@ -0,0 +1,400 @@
+///////////////////////////////////////////////////////////////////////////////
+// PlanetShader.cpp
+// ================
+// GLSL 3.30 core render path for the planet.
+///////////////////////////////////////////////////////////////////////////////
+
+#include "GL/glew.h"
+
+#include <iostream>
+#include <vector>
+#include "glm/gtc/matrix_inverse.hpp"
+#include "PlanetShader.h"
+
+
+
+// constants //////////////////////////////////////////////////////////////////
+const unsigned int FRAME_BINDING = 0;       // uniform buffer binding points
+const unsigned int TERRAIN_BINDING = 1;
+static_assert(TERRAIN_SHADE_SAMPLES == 64, "TERRAIN_BLOCK holds 64 rock shade samples");
+
+// the same lighting model as the fixed-function setup (colour material for
+// ambient and diffuse, infinite viewer), evaluated per pixel
+const char* FRAME_BLOCK = R"(
+layout(std140) uniform Frame
+{
+    mat4 modelView;
+    mat4 projection;
+    mat4 normalMatrix;
+    vec4 lightPosition;
+    vec4 lightAmbient;
+    vec4 lightDiffuse;
+    vec4 lightSpecular;
+    vec4 sceneAmbient;
+    vec4 materialSpecular;
+    float shininess;
+};
+)";
+
+// the planet's classification parameters, see Planet::getTerrainUniforms()
+// and Planet::getTerrainInputs() for what the colour attribute holds then
+const char* TERRAIN_BLOCK = R"(
+#ifdef CLASSIFY
+layout(std140) uniform Terrain
+{
+    vec4 palette[6];                // w = 1 if shaded by latitude
+    ivec4 biomeTable[3];            // biome by [arctic zone][altitude band]
+    vec4 rockShade[16];             // 64 samples, latitude -90 to 90 degrees
+    float radius;
+    float K;
+    float water;
+    float temp;
+    float minHeight;
+    float range;
+    float oblateness;
+    int terrestrial;
+};
+
+const float PI = 3.14159265;
+#endif
+)";
+
+// attribute locations are Planet's ATTRIB_POSITION, ATTRIB_NORMAL, ATTRIB_COLOR
+const char* VERTEX_SHADER = R"(
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 normal;
+layout(location = 2) in vec4 color;
+
+out vec3 eyePosition;
+out vec3 eyeNormal;
+out vec4 vertexColor;
+
+#ifdef CLASSIFY
+flat out vec2 dither;               // a per-vertex decision, so never blended
+
+// Planet::displaceVertex() leaves the sea floor to the shader: below the
+// water level the height is scaled by K once more, and so is the slope the
+// normal leans away from the radial direction u by
+void flattenSeaFloor(inout vec3 p, inout vec3 n, float relief)
+{
+    float height = minHeight + relief * range;
+    float r1 = radius + height * K;
+    float sea = radius + (minHeight + range * water) * K;
+    if (r1 >= sea)
+        return;
+
+    float r2 = sea + height * K * K;
+    vec3 u = normalize(vec3(p.xy / (r1 + oblateness), p.z / r1));
+    vec3 slope = u - n / max(dot(n, u), 0.001);
+    n = normalize(u - slope * (K * r1 / r2));
+    p = vec3((r2 + oblateness) * u.xy, r2 * u.z);
+}
+#endif
+
+void main()
+{
+    vec3 p = position;
+    vec3 n = normal;
+#ifdef CLASSIFY
+    flattenSeaFloor(p, n, color.x);
+#endif
+    vec4 e = modelView * vec4(p, 1.0);
+    eyePosition = e.xyz;
+    eyeNormal = mat3(normalMatrix) * n;
+    vertexColor = color;
+#ifdef CLASSIFY
+    dither = color.zw;
+#endif
+    gl_Position = projection * e;
+}
+)";
+
+const char* FRAGMENT_SHADER = R"(
+in vec3 eyePosition;
+in vec3 eyeNormal;
+in vec4 vertexColor;
+#ifdef CLASSIFY
+flat in vec2 dither;
+#endif
+
+out vec4 fragColor;
+
+#ifdef CLASSIFY
+float getRockShade(float latitude)
+{
+    float x = clamp((latitude / PI + 0.5) * 63.0, 0.0, 63.0);
+    int i = min(int(x), 62);
+    float a = rockShade[i / 4][i % 4];
+    float b = rockShade[(i + 1) / 4][(i + 1) % 4];
+    return mix(a, b, x - float(i));
+}
+
+// Planet::classifyVertex() and getBiomeColor(), per pixel
+vec3 classify(vec2 inputs, vec2 dither)
+{
+    float height = minHeight + inputs.x * range;
+    float latitude = (inputs.y - 0.5) * PI;
+    float aR = radius + height * K;
+
+    float absLat = abs(latitude);
+    float localTemp = (temp + 45.0) - absLat * 180.0 / PI;
+    float coeff = min(0.85 / 15.0 * localTemp, 0.91);
+    float snowHeight = (minHeight + coeff * range) * K;
+    float waterHeight = (minHeight + water * range) * K;
+    float sandHeight = waterHeight + (snowHeight - waterHeight) * 0.08;
+
+    bool wet = water > 0.0;
+    int band = wet && aR <= radius + waterHeight ? 0 :
+               terrestrial != 0 && aR < radius + sandHeight ? 1 :
+               wet && aR > radius + snowHeight ? 3 : 2;
+
+    int zone = 0;
+    float polar = absLat - (PI / 4.0 + temp * PI / 180.0);
+    if (wet && polar > 0.0 && dither.x * 0.5 < sqrt(sqrt(polar)))
+        zone = band == 0 && dither.y * 0.5 < pow(polar, 0.9) ? 2 : 1;
+
+    vec4 biome = palette[biomeTable[zone][band]];
+    return biome.rgb + biome.w * getRockShade(latitude);
+}
+#endif
+
+void main()
+{
+#ifdef CLASSIFY
+    vec4 vertexColor = vec4(classify(vertexColor.xy, dither), 1.0);
+#endif
+    vec3 n = normalize(eyeNormal);
+    vec3 l = lightPosition.w == 0.0 ? normalize(lightPosition.xyz)
+                                    : normalize(lightPosition.xyz - eyePosition);
+    vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));
+
+    float diffuse = max(dot(n, l), 0.0);
+    float specular = diffuse > 0.0 ? pow(max(dot(n, h), 0.0), shininess) : 0.0;
+
+    vec3 rgb = vertexColor.rgb * (sceneAmbient.rgb + lightAmbient.rgb + diffuse * lightDiffuse.rgb)
+             + specular * lightSpecular.rgb * materialSpecular.rgb;
+    fragColor = vec4(rgb, vertexColor.a);
+}
+)";
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ctor
+// defaults match fixed-function GL: white light from +z, 0.2 scene ambient
+///////////////////////////////////////////////////////////////////////////////
+PlanetShader::PlanetShader() : program(0), classifyProgram(0), ubo(0), terrainUbo(0), terrain(), classify(false)
+{
+    frame.modelView = glm::mat4(1.0f);
+    frame.projection = glm::mat4(1.0f);
+    frame.normalMatrix = glm::mat4(1.0f);
+    frame.lightPosition = glm::vec4(0, 0, 1, 0);
+    frame.lightAmbient = glm::vec4(0, 0, 0, 1);
+    frame.lightDiffuse = glm::vec4(1, 1, 1, 1);
+    frame.lightSpecular = glm::vec4(1, 1, 1, 1);
+    frame.sceneAmbient = glm::vec4(0.2f, 0.2f, 0.2f, 1);
+    frame.materialSpecular = glm::vec4(0, 0, 0, 1);
+    frame.shininess = 0;
+    frame.padding[0] = frame.padding[1] = frame.padding[2] = 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// build both programs and the uniform buffers
+///////////////////////////////////////////////////////////////////////////////
+bool PlanetShader::init()
+{
+    release();
+    if(!glCreateProgram || !glBindBufferBase)
+    {
+        std::cerr << "PlanetShader: GL 3.3 is not available" << std::endl;
+        return false;
+    }
+
+    program = link(false);
+    classifyProgram = link(true);
+    if(!program || !classifyProgram)
+    {
+        release();
+        return false;
+    }
+
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(Frame), &frame, GL_DYNAMIC_DRAW);
+    glGenBuffers(1, &terrainUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, terrainUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(Terrain), &terrain, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    return true;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// compile and link one program, with shader classification or without
+// returns 0 and prints the log on failure
+///////////////////////////////////////////////////////////////////////////////
+GLuint PlanetShader::link(bool classify) const
+{
+    GLuint vs = compile(GL_VERTEX_SHADER, VERTEX_SHADER, classify);
+    GLuint fs = compile(GL_FRAGMENT_SHADER, FRAGMENT_SHADER, classify);
+    if(!vs || !fs)
+    {
+        glDeleteShader(vs);
+        glDeleteShader(fs);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vs);
+    glAttachShader(program, fs);
+    glLinkProgram(program);
+    glDeleteShader(vs);                     // freed with the program
+    glDeleteShader(fs);
+
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if(!linked)
+    {
+        GLint length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        std::vector<char> log(length + 1);
+        glGetProgramInfoLog(program, length, 0, log.data());
+        std::cerr << "PlanetShader: link failed\n" << log.data() << std::endl;
+        glDeleteProgram(program);
+        return 0;
+    }
+
+    glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Frame"), FRAME_BINDING);
+    if(classify)
+        glUniformBlockBinding(program, glGetUniformBlockIndex(program, "Terrain"), TERRAIN_BINDING);
+    return program;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// compile one stage; the shared uniform blocks are prepended to its source
+// returns 0 and prints the log on failure
+///////////////////////////////////////////////////////////////////////////////
+GLuint PlanetShader::compile(GLenum type, const char* source, bool classify) const
+{
+    const char* sources[] = { "#version 330 core\n", classify ? "#define CLASSIFY\n" : "",
+                              FRAME_BLOCK, TERRAIN_BLOCK, source };
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 5, sources, 0);
+    glCompileShader(shader);
+
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if(compiled)
+        return shader;
+
+    GLint length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+    std::vector<char> log(length + 1);
+    glGetShaderInfoLog(shader, length, 0, log.data());
+    std::cerr << "PlanetShader: " << (type == GL_VERTEX_SHADER ? "vertex" : "fragment")
+              << " shader failed\n" << log.data() << std::endl;
+    glDeleteShader(shader);
+    return 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// delete the GL objects; needs the context they were made in
+///////////////////////////////////////////////////////////////////////////////
+void PlanetShader::release()
+{
+    if(program)
+        glDeleteProgram(program);
+    if(classifyProgram)
+        glDeleteProgram(classifyProgram);
+    if(ubo)
+        glDeleteBuffers(1, &ubo);
+    if(terrainUbo)
+        glDeleteBuffers(1, &terrainUbo);
+    program = classifyProgram = ubo = terrainUbo = 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// setters
+///////////////////////////////////////////////////////////////////////////////
+void PlanetShader::setMatrices(const glm::mat4& modelView, const glm::mat4& projection)
+{
+    frame.modelView = modelView;
+    frame.projection = projection;
+    frame.normalMatrix = glm::inverseTranspose(modelView);
+}
+
+void PlanetShader::setLight(const glm::vec4& position, const glm::vec4& ambient,
+                            const glm::vec4& diffuse, const glm::vec4& specular)
+{
+    frame.lightPosition = position;
+    frame.lightAmbient = ambient;
+    frame.lightDiffuse = diffuse;
+    frame.lightSpecular = specular;
+}
+
+void PlanetShader::setSceneAmbient(const glm::vec4& ambient)
+{
+    frame.sceneAmbient = ambient;
+}
+
+void PlanetShader::setMaterial(const glm::vec4& specular, float shininess)
+{
+    frame.materialSpecular = specular;
+    frame.shininess = shininess;
+}
+
+void PlanetShader::setTerrain(const TerrainUniforms& t)
+{
+    for(int i = 0; i < BIOME_COUNT; ++i)
+        terrain.palette[i] = glm::vec4(t.palette[i][0], t.palette[i][1], t.palette[i][2],
+                                       i == BIOME_ROCK ? 1.0f : 0.0f);
+    for(int i = 0; i < 3; ++i)
+        terrain.biomeTable[i] = glm::ivec4(t.biomeTable[i][0], t.biomeTable[i][1],
+                                           t.biomeTable[i][2], t.biomeTable[i][3]);
+    for(int i = 0; i < TERRAIN_SHADE_SAMPLES / 4; ++i)
+        terrain.rockShade[i] = glm::vec4(t.rockShade[i * 4], t.rockShade[i * 4 + 1],
+                                         t.rockShade[i * 4 + 2], t.rockShade[i * 4 + 3]);
+    terrain.radius = t.radius;
+    terrain.K = t.K;
+    terrain.water = t.water;
+    terrain.temp = t.temp;
+    terrain.minHeight = t.minHeight;
+    terrain.range = t.range;
+    terrain.oblateness = t.oblateness;
+    terrain.terrestrial = t.terrestrial ? 1 : 0;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// send the frame state and switch to the program; with shader classification
+// the terrain uniforms go too, which is all a water or temperature change costs
+///////////////////////////////////////////////////////////////////////////////
+void PlanetShader::begin()
+{
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Frame), &frame);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_BINDING, ubo);
+    if(classify)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, terrainUbo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(Terrain), &terrain);
+        glBindBufferBase(GL_UNIFORM_BUFFER, TERRAIN_BINDING, terrainUbo);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glUseProgram(classify ? classifyProgram : program);
+}
+
+void PlanetShader::end() const
+{
+    glUseProgram(0);
+}
@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////
+// PlanetShader.h
+// ==============
+// GLSL 3.30 core render path for the planet: per-pixel Blinn-Phong lighting
+// of the vertex colours, with the camera, light and material of the frame
+// in one uniform buffer. It reads the interleaved stream through the generic
+// attributes Planet::enableArrays() sets up, so anything drawn by Planet or
+// PlanetLOD between begin() and end() goes through it.
+// A second program draws planets with shader classification: it flattens the
+// sea floor per vertex and classifies and colours the terrain per pixel from
+// the terrain inputs in the colour attribute, with the planet's water level,
+// temperature and palette in a second uniform buffer.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef GEOMETRY_PlanetShader_H
+#define GEOMETRY_PlanetShader_H
+
+#include "glm/vec4.hpp"
+#include "glm/mat4x4.hpp"
+#include "Planet.h"
+
+class PlanetShader
+{
+public:
+    // ctor/dtor
+    PlanetShader();
+    ~PlanetShader() {}                      // GL objects need a context, see release()
+
+    // compile and link the program and create the uniform buffer
+    // needs a current GL 3.3 context; prints the log and returns false on failure
+    bool init();
+    void release();
+    bool isReady() const                    { return program != 0; }
+
+    // frame state, sent to the uniform buffer by begin()
+    // the light position is in eye space (w = 0 for a directional light)
+    void setMatrices(const glm::mat4& modelView, const glm::mat4& projection);
+    void setLight(const glm::vec4& position, const glm::vec4& ambient,
+                  const glm::vec4& diffuse, const glm::vec4& specular);
+    void setSceneAmbient(const glm::vec4& ambient);
+    void setMaterial(const glm::vec4& specular, float shininess);
+
+    // classify the terrain per pixel with these uniforms, or draw the
+    // vertex colours; sent to the second uniform buffer by begin()
+    void setTerrain(const TerrainUniforms& terrain);
+    void setClassification(bool classify)   { this->classify = classify; }
+
+    // draw calls between begin() and end() use the shader
+    void begin();
+    void end() const;
+
+private:
+    // uniform block "Frame", std140 layout
+    struct Frame
+    {
+        glm::mat4 modelView;
+        glm::mat4 projection;
+        glm::mat4 normalMatrix;             // upper 3x3 used
+        glm::vec4 lightPosition;
+        glm::vec4 lightAmbient;
+        glm::vec4 lightDiffuse;
+        glm::vec4 lightSpecular;
+        glm::vec4 sceneAmbient;
+        glm::vec4 materialSpecular;
+        float shininess;
+        float padding[3];
+    };
+
+    // uniform block "Terrain", std140 layout
+    struct Terrain
+    {
+        glm::vec4 palette[BIOME_COUNT];     // w = 1 if shaded by latitude (rock)
+        glm::ivec4 biomeTable[3];
+        glm::vec4 rockShade[TERRAIN_SHADE_SAMPLES / 4];
+        float radius, K, water, temp;
+        float minHeight, range, oblateness;
+        int terrestrial;
+    };
+
+    PlanetShader(const PlanetShader&);      // not copyable
+    PlanetShader& operator=(const PlanetShader&);
+
+    // member functions
+    unsigned int compile(unsigned int type, const char* source, bool classify) const;
+    unsigned int link(bool classify) const;
+
+    // member vars
+    unsigned int program;
+    unsigned int classifyProgram;
+    unsigned int ubo;
+    unsigned int terrainUbo;
+    Frame frame;
+    Terrain terrain;
+    bool classify;
+};
+
+#endif
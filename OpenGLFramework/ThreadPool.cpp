@@ -0,0 +1,203 @@
+///////////////////////////////////////////////////////////////////////////////
+// ThreadPool.cpp
+// ==============
+// Work-stealing thread pool for splitting planet generation across cores.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "ThreadPool.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ctor/dtor
+///////////////////////////////////////////////////////////////////////////////
+ThreadPool::ThreadPool(unsigned int threadCount) : pending(0), stopping(false)
+{
+    start(threadCount);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// restart the workers at another count, for measuring how generation scales
+// no parallelFor() may be running
+///////////////////////////////////////////////////////////////////////////////
+void ThreadPool::setThreadCount(unsigned int threadCount)
+{
+    stop();
+    start(threadCount);
+}
+
+void ThreadPool::start(unsigned int threadCount)
+{
+    if(threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+    stopping = false;
+    for(unsigned int i = 0; i < threadCount; ++i)
+        queues.push_back(std::unique_ptr<Queue>(new Queue));
+    for(unsigned int i = 0; i < threadCount; ++i)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for(std::size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    workers.clear();
+    queues.clear();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// split [begin, end) into chunks, deal them round-robin onto the worker
+// queues, then help out until the last chunk has finished
+// the queued tasks point at this frame, so it must not be left before then,
+// not even by an exception: run() catches them and they are rethrown here
+///////////////////////////////////////////////////////////////////////////////
+void ThreadPool::parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& fn)
+{
+    if(end <= begin)
+        return;
+    if(grain < 1)
+        grain = 1;
+
+    int chunks = (end - begin + grain - 1) / grain;
+    if(chunks == 1)
+    {
+        fn(begin, end);
+        return;
+    }
+
+    Batch batch;
+    batch.fn = &fn;
+    batch.remaining = chunks;
+    batch.failed = false;
+    unsigned int queueCount = (unsigned int)queues.size();
+    for(int c = 0; c < chunks; ++c)
+    {
+        Task task = { &batch, begin + c * grain, std::min(end, begin + (c + 1) * grain) };
+        Queue& queue = *queues[c % queueCount];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        pending += chunks;
+    }
+    wake.notify_all();
+
+    // the caller is not a worker, so it may steal from every queue
+    Task task;
+    while(batch.remaining > 0 && steal((unsigned int)queues.size(), task))
+        run(task);
+
+    {
+        std::unique_lock<std::mutex> guard(sleepLock);
+        done.wait(guard, [&batch]() { return batch.remaining == 0; });
+    }
+    if(batch.error)
+        std::rethrow_exception(batch.error);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// worker: drain own queue, then steal, then sleep until more work arrives
+///////////////////////////////////////////////////////////////////////////////
+void ThreadPool::workerLoop(unsigned int index)
+{
+    Task task;
+    for(;;)
+    {
+        if(pop(index, task) || steal(index, task))
+        {
+            run(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wake.wait(guard, [this]() { return stopping || pending > 0; });
+        if(stopping && pending == 0)
+            return;
+    }
+}
+
+bool ThreadPool::pop(unsigned int index, Task& task)
+{
+    Queue& queue = *queues[index];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.tasks.empty())
+        return false;
+
+    task = queue.tasks.back();
+    queue.tasks.pop_back();
+    --pending;
+    return true;
+}
+
+bool ThreadPool::steal(unsigned int index, Task& task)
+{
+    unsigned int count = (unsigned int)queues.size();
+    for(unsigned int k = 1; k <= count; ++k)
+    {
+        unsigned int victim = (index + k) % count;
+        if(victim == index)
+            continue;
+
+        Queue& queue = *queues[victim];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if(queue.tasks.empty())
+            continue;
+
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        --pending;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::run(const Task& task)
+{
+    Batch& batch = *task.batch;
+    if(!batch.failed)
+    {
+        try
+        {
+            (*batch.fn)(task.first, task.last);
+        }
+        catch(...)
+        {
+            if(!batch.failed.exchange(true))
+                batch.error = std::current_exception();
+        }
+    }
+
+    // counted down even if it threw or was skipped, so the caller returns
+    if(--batch.remaining == 0)
+    {
+        // take the lock so the waiting caller cannot miss the notification
+        std::lock_guard<std::mutex> guard(sleepLock);
+        done.notify_all();
+    }
+}
@@ -0,0 +1,86 @@
+///////////////////////////////////////////////////////////////////////////////
+// ThreadPool.h
+// ============
+// Work-stealing thread pool for splitting planet generation across cores.
+// Every worker owns a deque of tasks: it pops its own work from the back and,
+// when that runs dry, steals from the front of the other workers' deques.
+// The thread calling parallelFor() steals too instead of sitting idle.
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef GEOMETRY_ThreadPool_H
+#define GEOMETRY_ThreadPool_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    // ctor/dtor
+    explicit ThreadPool(unsigned int threadCount = 0);  // 0 = one per hardware thread
+    ~ThreadPool();
+
+    // pool shared by the whole program
+    static ThreadPool& instance();
+
+    unsigned int getThreadCount() const     { return (unsigned int)workers.size(); }
+    void setThreadCount(unsigned int threadCount);      // 0 = one per hardware thread; only while idle
+
+    // call fn(first, last) over [begin, end) in chunks of at most grain items
+    // and return once every chunk has run; chunks may run in any order
+    // if fn throws, the chunks not yet started are skipped and the first
+    // exception is rethrown here once the others have finished
+    void parallelFor(int begin, int end, int grain, const std::function<void(int, int)>& fn);
+
+    // # of chunks parallelFor() should aim for, enough to keep all threads busy
+    int getChunkTarget() const              { return (int)workers.size() * 4; }
+
+private:
+    // one parallelFor() call, on its caller's stack
+    struct Batch
+    {
+        const std::function<void(int, int)>* fn;
+        std::atomic<int> remaining;         // chunks still running
+        std::atomic<bool> failed;
+        std::exception_ptr error;           // the first thrown, written by whoever set failed
+    };
+
+    struct Task
+    {
+        Batch* batch;
+        int first, last;
+    };
+
+    struct Queue
+    {
+        std::deque<Task> tasks;
+        std::mutex lock;
+    };
+
+    ThreadPool(const ThreadPool&);              // not copyable
+    ThreadPool& operator=(const ThreadPool&);
+
+    void start(unsigned int threadCount);
+    void stop();
+    void workerLoop(unsigned int index);
+    bool pop(unsigned int index, Task& task);   // from the back of own queue
+    bool steal(unsigned int index, Task& task); // from the front of any other queue
+    void run(const Task& task);
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> pending;                   // tasks queued, not yet taken
+    std::mutex sleepLock;
+    std::condition_variable wake;               // work queued or stopping
+    std::condition_variable done;               // a parallelFor finished
+    bool stopping;
+};
+
+#endif
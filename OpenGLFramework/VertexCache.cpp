@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////
+// VertexCache.cpp
+// ===============
+// Post-transform vertex cache model for 16-bit triangle lists.
+///////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <vector>
+#include "VertexCache.h"
+
+
+
+// constants //////////////////////////////////////////////////////////////////
+const unsigned short RESTART_INDEX = 0xffff;
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ctor
+///////////////////////////////////////////////////////////////////////////////
+VertexCache::VertexCache(int size) : size(size > 3 ? size : 3)
+{
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tipsify: emit every unemitted triangle around the current fan vertex, then
+// pick as the next fan the neighbour that entered the cache longest ago but
+// would still be in it after its own fan; when none qualifies, back up to
+// the most recently used vertex with triangles left, else the next in order
+// the cache is modelled by when each vertex entered it: time counts entries,
+// so a vertex is cached while fewer than size vertices entered after it
+///////////////////////////////////////////////////////////////////////////////
+void VertexCache::optimize(unsigned short* indices, std::size_t indexCount, unsigned int vertexCount) const
+{
+    std::size_t triangleCount = indexCount / 3;
+    if(triangleCount == 0)
+        return;
+
+    // triangles around each vertex, as one array sliced by offsets
+    std::vector<unsigned int> offsets(vertexCount + 1, 0);
+    for(std::size_t i = 0; i < triangleCount * 3; ++i)
+        ++offsets[indices[i] + 1];
+    for(unsigned int v = 0; v < vertexCount; ++v)
+        offsets[v + 1] += offsets[v];
+
+    std::vector<unsigned int> adjacency(triangleCount * 3);
+    std::vector<unsigned int> next(offsets.begin(), offsets.end() - 1);
+    for(std::size_t i = 0; i < triangleCount * 3; ++i)
+        adjacency[next[indices[i]]++] = (unsigned int)(i / 3);
+
+    std::vector<int> live(vertexCount);             // triangles left around each vertex
+    for(unsigned int v = 0; v < vertexCount; ++v)
+        live[v] = offsets[v + 1] - offsets[v];
+
+    std::vector<int> entered(vertexCount, 0);       // time each vertex entered the cache
+    std::vector<char> emitted(triangleCount, 0);
+    std::vector<unsigned short> deadEnds;           // recently used vertices, a stack
+    std::vector<unsigned short> candidates;         // vertices of the current fan
+    std::vector<unsigned short> result;
+    result.reserve(triangleCount * 3);
+    deadEnds.reserve(triangleCount * 3);
+
+    int time = size + 1;
+    unsigned int cursor = 0;                        // no vertex before it has triangles left
+    int fan = 0;
+    while(fan >= 0)
+    {
+        candidates.clear();
+        for(unsigned int a = offsets[fan]; a < offsets[fan + 1]; ++a)
+        {
+            unsigned int t = adjacency[a];
+            if(emitted[t])
+                continue;
+            emitted[t] = 1;
+
+            for(int k = 0; k < 3; ++k)
+            {
+                unsigned short v = indices[t * 3 + k];
+                result.push_back(v);
+                deadEnds.push_back(v);
+                candidates.push_back(v);
+                --live[v];
+                if(time - entered[v] > size)
+                    entered[v] = time++;
+            }
+        }
+
+        // the oldest cached neighbour that stays cached through its fan
+        fan = -1;
+        int best = -1;
+        for(std::size_t i = 0; i < candidates.size(); ++i)
+        {
+            unsigned short v = candidates[i];
+            if(live[v] == 0)
+                continue;
+            int priority = 0;
+            if(time - entered[v] + 2 * live[v] <= size)
+                priority = time - entered[v];
+            if(priority > best)
+            {
+                best = priority;
+                fan = v;
+            }
+        }
+        if(fan >= 0)
+            continue;
+
+        // dead end
+        while(!deadEnds.empty() && fan < 0)
+        {
+            unsigned short v = deadEnds.back();
+            deadEnds.pop_back();
+            if(live[v] > 0)
+                fan = v;
+        }
+        while(fan < 0 && cursor < vertexCount)
+        {
+            if(live[cursor] > 0)
+                fan = cursor;
+            else
+                ++cursor;
+        }
+    }
+
+    std::copy(result.begin(), result.end(), indices);
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+// replay the indices through a FIFO cache and count the vertices it had
+// to transform; a cache of this size is emptied first
+// strip restart indices (0xffff) are not vertices and are skipped
+///////////////////////////////////////////////////////////////////////////////
+std::size_t VertexCache::countMisses(const unsigned short* indices, std::size_t indexCount, unsigned int vertexCount) const
+{
+    std::vector<std::size_t> entered(vertexCount, 0);
+    std::size_t time = size + 1;
+    std::size_t misses = 0;
+    for(std::size_t i = 0; i < indexCount; ++i)
+    {
+        unsigned short v = indices[i];
+        if(v == RESTART_INDEX)
+            continue;
+        if(time - entered[v] > (std::size_t)size)
+        {
+            entered[v] = time++;
+            ++misses;
+        }
+    }
+    return misses;
+}
@@ -12,8 +12,15 @@
 #include <iomanip>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
 
 #include "Planet.h"
+#include "PlanetLOD.h"
+#include "PlanetShader.h"
+#include "ThreadPool.h"
 #include "stb_image.h"
 
 using namespace std;
@@ -26,7 +33,12 @@ void keyboardCB(unsigned char key, int x, int y);
 void mouseCB(int button, int stat, int x, int y);
 void mouseMotionCB(int x, int y);
 
-void parseFile(string file);
+void parseFile(string file, bool reload = false);
+Params getPlanetParams();
+void resetLOD();
+uint64_t hashGrammar(const string& file);
+void benchmarkNoise();
+void benchmarkScaling(int sectors, int stacks);
 string clean(const string& str, const string& fill = " ", const string& whitespace = " \t");
 void initGL();
 int  initGLUT(int argc, char **argv);
@@ -37,6 +49,7 @@ void drawString(const char *str, int x, int y, float color[4], void *font);
 void drawString3D(const char *str, float pos[3], float color[4], void *font);
 void toOrtho();
 void toPerspective();
+float getNearClip();
 void background();
 GLuint loadBackground();
 
@@ -45,6 +58,7 @@ GLuint loadBackground();
 const int   SCREEN_WIDTH    = 800;
 const int   SCREEN_HEIGHT   = 600;
 const float CAMERA_DISTANCE = 4.0f;
+const float FOV_Y           = 40.0f;
 const int   TEXT_WIDTH      = 8;
 const int   TEXT_HEIGHT     = 13;
 
@@ -74,16 +88,29 @@ int imageWidth;
 int imageHeight;
 Planet planet;
 Params params;
+PlanetLOD* lod = 0;             // chunked LOD over planet, if the grammar asks for it
+string grammarFile;             // reloaded with 'r'
+bool gpuBuffers = false;        // draw the planet from buffer objects, toggled with 'b'
+PlanetShader shader;
+bool useShaders = false;        // per-pixel lighting in GLSL 3.30, toggled with 's'
+bool halfFloatVertices = false; // GL can fetch the packed vertex format's half-float positions
 
 
 int main(int argc, char **argv)
 {
     string filename;
 
+    if (argc > 1 && !string(argv[1]).compare("--bench")) {
+        benchmarkNoise();
+        return 0;
+    }
+    if (argc > 1 && !string(argv[1]).compare("--scaling")) {
+        benchmarkScaling(argc > 3 ? stoi(argv[2]) : 8192, argc > 3 ? stoi(argv[3]) : 4096);
+        return 0;
+    }
+
     cout << "Please enter the planet grammar filename: ";
     cin >> filename;
-    // planet: min sector = 3, min stack = 2
-    parseFile(filename);
 
     // init global vars
     initSharedMem();
@@ -92,6 +119,10 @@ int main(int argc, char **argv)
     initGLUT(argc, argv);
     initGL();
 
+    // planet: min sector = 3, min stack = 2
+    // after GL, so shader classification is only asked for if shaders are up
+    parseFile(filename);
+
     GLuint result = loadBackground();
 
     glutMainLoop();
@@ -101,23 +132,42 @@ int main(int argc, char **argv)
 
 
 
-/* initialize planet from file */
-void parseFile(string file)
+/*
+ * initialize planet from file
+ * on reload, the planet keeps its seed (unless the grammar sets one) and
+ * only regenerates the stages the changed parameters invalidate
+ */
+void parseFile(string file, bool reload)
 {
     ifstream scene(file);
+    grammarFile = file;
 
     /* initialize random number generator */
     time_t t;
     srand((unsigned)time(&t));
 
+    // random seed unless the grammar pins one down
+    params = Params();
+    params.seed = ((uint64_t)rand() << 32) ^ ((uint64_t)rand() << 16) ^ (uint64_t)t;
+    if (reload)
+        params.seed = planet.getSeed();
+
     // Check if file is openable
     if (!scene.is_open()) {
         cout << "Unable to open file \"" << file << "\"" << endl;
+        if (reload)
+            return;
         cout << "Generating terrestrial planet instead." << endl;
-        planet = Planet(params, 1.0f, 512, 256);
+        planet = Planet(getPlanetParams(), 1.0f, 512, 256);
         return;
     }
 
+    // the heightfield and mesh are cached next to the grammar, tagged with a
+    // hash of its noise tokens; every other setting is in the headers as is
+    params.cacheFile = file + ".heights";
+    params.meshCacheFile = file + ".mesh";
+    params.grammarHash = hashGrammar(file);
+
     string line, token, b[4];
     string delim = " ";
     size_t pos;
@@ -150,6 +200,49 @@ void parseFile(string file)
         case 'W':
             params.W = stof(line);
             break;
+        case 'N':
+            params.seed = stoull(line);
+            break;
+        case 'P':
+            params.noise = line.compare("simplex") ? NOISE_PERLIN : NOISE_SIMPLEX;
+            break;
+        case 'H':
+            params.analyticNormals = line.compare("flat") != 0;
+            break;
+        case 'V':
+            params.sharedVertices = line.compare("separate") != 0;
+            break;
+        case 'I':
+            params.triangleStrips = line.compare("strip") == 0;
+            break;
+        case 'Q':
+            params.packedVertices = line.compare("packed") == 0;
+            break;
+        case 'U':
+            params.gpuOnly = line.compare("gpu") == 0;
+            break;
+        case 'A':
+            params.shaderClassification = line.compare("shader") == 0;
+            break;
+        case 'G':
+            params.topology = line.compare("cube") ? TOPOLOGY_UV : TOPOLOGY_CUBE;
+            break;
+        case 'L':
+        {
+            // screen-space error in pixels, then optional memory budget in MiB
+            istringstream detail(line);
+            detail >> params.lodError >> params.lodBudget;
+            break;
+        }
+        case 'F':
+        {
+            // octave count (or "auto"), then optional lacunarity and gain
+            istringstream fractal(line);
+            fractal >> type;
+            params.octaves = type.compare("auto") ? stoi(type) : 0;
+            fractal >> params.lacunarity >> params.gain;
+            break;
+        }
         case 'C':
             while ((pos = line.find(delim)) != string::npos) {
                 token = line.substr(0, pos);
@@ -159,19 +252,217 @@ void parseFile(string file)
 
             if (line.compare("terrestrial")) params.terrestrial = false;
             if (!line.compare("random")) {
-                params.red = rand() % 100 * 0.01;
-                params.green = rand() % 100 * 0.01;
-                params.blue = rand() % 100 * 0.01;
+                params.palette[BIOME_ROCK][0] = rand() % 100 * 0.01;
+                params.palette[BIOME_ROCK][1] = rand() % 100 * 0.01;
+                params.palette[BIOME_ROCK][2] = rand() % 100 * 0.01;
             }
             else if (!b[0].compare("color")) {
-                params.red = stof(b[1]) / 255.0;
-                params.green = stof(b[2]) / 255.0;
-                params.blue = stof(line) / 255.0;
+                params.palette[BIOME_ROCK][0] = stof(b[1]) / 255.0;
+                params.palette[BIOME_ROCK][1] = stof(b[2]) / 255.0;
+                params.palette[BIOME_ROCK][2] = stof(line) / 255.0;
+            }
+            break;
+        case 'B':
+        {
+            // biome name, then its colour as 3 RGB values, or "table", the
+            // land kind, zone and altitude band, then the biome found there
+            istringstream biome(line);
+            biome >> type;
+            if (!type.compare("table")) {
+                string kind, zone, band, name;
+                biome >> kind >> zone >> band >> name;
+                int zoneIndex = getBiomeZone(zone), bandIndex = getBiomeBand(band);
+                Biome i = getBiome(name);
+                if (!biome || (kind.compare("terrestrial") && kind.compare("other")) || zoneIndex < 0 || bandIndex < 0 || i == BIOME_COUNT) {
+                    cout << "Ignoring biome \"" << line << "\"" << endl;
+                    break;
+                }
+                params.biomeTable[kind.compare("terrestrial") ? 1 : 0][zoneIndex][bandIndex] = (unsigned char)i;
+                break;
             }
+            float rgb[3];
+            biome >> rgb[0] >> rgb[1] >> rgb[2];
+            Biome i = getBiome(type);
+            if (i == BIOME_COUNT || !biome) {
+                cout << "Ignoring biome \"" << line << "\"" << endl;
+                break;
+            }
+            for (int c = 0; c < 3; ++c)
+                params.palette[i][c] = rgb[c] / 255.0;
+            break;
+        }
+        }
+    }
+
+    if (params.packedVertices && !halfFloatVertices)
+        cout << "Half-float vertices unavailable, using the float vertex format" << endl;
+    if (params.packedVertices && halfFloatVertices && params.shaderClassification && useShaders)
+        cout << "Shader classification needs the float vertex format, classifying vertices instead" << endl;
+
+    if (reload) {
+        const char* stageNames[] = { "unchanged", "repainted", "recoloured", "remeshed", "regenerated" };
+        Stage stage = planet.setParams(getPlanetParams());
+        cout << "Reloaded \"" << file << "\": " << stageNames[stage] << endl;
+    }
+    else {
+        planet = Planet(getPlanetParams(), 1.0f, 512, 256);    // radius, sectors, stacks, non-smooth (flat) shading
+        cout << "Seed: " << params.seed << endl;
+    }
+
+    resetLOD();
+}
+
+
+
+/*
+ * the grammar's parameters as the planet gets them
+ * the shader classifies the terrain only while shaders draw it; fixed-function
+ * drawing needs the colours on the vertices. Packed vertices need GL to fetch
+ * half floats, without that the float format is used
+ */
+Params getPlanetParams()
+{
+    Params p = params;
+    p.shaderClassification = params.shaderClassification && useShaders;
+    p.packedVertices = params.packedVertices && halfFloatVertices;
+    return p;
+}
+
+
+
+/*
+ * LOD chunks are baked from the planet, so they start over when it changes
+ */
+void resetLOD()
+{
+    delete lod;
+    lod = 0;
+    if (params.lodError > 0)
+        lod = new PlanetLOD(planet, 32, params.lodError, (size_t)params.lodBudget << 20);
+}
+
+
+
+/*
+ * near clip distance of the perspective projection
+ * LOD close-ups come within a hair of the surface, so pull the near plane in with them
+ */
+float getNearClip()
+{
+    if (lod)
+        return max(0.0001f, min(1.0f, (cameraDistance - 1.0f) * 0.5f));
+    return 1.0f;
+}
+
+
+
+/*
+ * 64-bit FNV-1a hash of the grammar lines that decide the heights: the seed
+ * (N), noise (P), fractal (F) and topology (G) tokens, 0 if it cannot be read;
+ * colour, temperature and shape edits leave it alone, so they keep the caches
+ */
+uint64_t hashGrammar(const string& file)
+{
+    ifstream in(file);
+    if (!in.is_open())
+        return 0;
+
+    uint64_t hash = 14695981039346656037ULL;
+    string line;
+    while (getline(in, line)) {
+        line = clean(line);
+        if (line.empty() || string("NPFG").find(line[0]) == string::npos)
+            continue;
+        line += '\n';
+        for (char c : line) {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+
+
+/*
+ * time a full generation (noise, heightfield and mesh, no caches) at
+ * 1, 2, 4, ... threads up to one per hardware thread, and report the
+ * speedup over one thread and the efficiency per thread
+ */
+void benchmarkScaling(int sectors, int stacks)
+{
+    ThreadPool& pool = ThreadPool::instance();
+    unsigned int hardware = max(1u, thread::hardware_concurrency());
+    vector<unsigned int> counts;
+    for (unsigned int n = 1; n < hardware; n *= 2)
+        counts.push_back(n);
+    counts.push_back(hardware);
+
+    Params params;
+    params.seed = 1;
+    cout << sectors << "x" << stacks << ", " << hardware << " hardware threads" << endl;
+
+    double single = 0;
+    for (unsigned int threads : counts) {
+        pool.setThreadCount(threads);
+        auto start = chrono::steady_clock::now();
+        {
+            Planet planet(params, 1.0f, sectors, stacks);
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (threads == 1)
+            single = seconds;
+        cout << setw(4) << threads << " threads: " << fixed << setprecision(2) << seconds << " s, speedup "
+             << single / seconds << ", efficiency " << setprecision(0) << 100 * single / seconds / threads << "%" << endl;
     }
+    pool.setThreadCount(0);
+}
 
-    planet = Planet(params, 1.0f, 512, 256);    // radius, sectors, stacks, non-smooth (flat) shading
+
+
+/*
+ * time each terrain noise backend over the sample points of the default
+ * 512x256 planet (6 octaves, as the default grammar generates it)
+ */
+void benchmarkNoise()
+{
+    const int sectors = 512, stacks = 256, octaves = 6, runs = 5;
+    const float PI = acos(-1);
+    const int count = (stacks + 1) * (sectors + 1);
+
+    vector<float> x(count), y(count), z(count), out(count);
+    shared_ptr<const NoiseTables> tables = make_shared<NoiseTables>(1);
+    NoiseContext perlin(tables);
+    SimplexNoise simplex(tables);
+    const NoiseBackend* backends[] = { &perlin, &simplex };
+
+    for (const NoiseBackend* backend : backends) {
+        double best = 0;
+        for (int run = 0; run < runs; ++run) {
+            for (int i = 0, n = 0; i <= stacks; ++i) {
+                float stackAngle = PI / 2 - i * PI / stacks;
+                for (int j = 0; j <= sectors; ++j, ++n) {
+                    float sectorAngle = j * 2 * PI / sectors;
+                    x[n] = 2 * cosf(stackAngle) * cosf(sectorAngle);
+                    y[n] = 2 * cosf(stackAngle) * sinf(sectorAngle);
+                    z[n] = 2 * sinf(stackAngle);
+                }
+            }
+
+            auto start = chrono::steady_clock::now();
+            for (int k = 0; k < octaves; ++k) {
+                backend->noise3(x.data(), y.data(), z.data(), out.data(), count);
+                for (int n = 0; n < count; ++n) {
+                    x[n] *= 2; y[n] *= 2; z[n] *= 2;
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            double rate = count * octaves / seconds;
+            if (rate > best) best = rate;
+        }
+        cout << setw(8) << backend->getName() << ": " << fixed << setprecision(1)
+             << best / 1e6 << " M samples/s" << endl;
+    }
 }
 
 
@@ -244,6 +535,21 @@ int initGLUT(int argc, char **argv)
  */
 void initGL()
 {
+    // buffer objects are kept on the GPU when the driver has them (GL 1.5)
+    GLenum err = glewInit();
+    gpuBuffers = err == GLEW_OK && GLEW_VERSION_1_5;
+    if (!gpuBuffers)
+        cout << "Buffer objects unavailable, drawing from client arrays" << endl;
+
+    // the planet is lit per pixel by shaders where GL 3.3 allows; the
+    // fixed-function lights and materials below remain the fallback
+    useShaders = GLEW_VERSION_3_3 && shader.init();
+    if (!useShaders)
+        cout << "GLSL 3.30 unavailable, using fixed-function lighting" << endl;
+
+    // GL_HALF_FLOAT vertex arrays are core in 3.0, an extension before
+    halfFloatVertices = err == GLEW_OK && (GLEW_VERSION_3_0 || GLEW_ARB_half_float_vertex);
+
     glShadeModel(GL_SMOOTH);                    // shading mathod: GL_SMOOTH or GL_FLAT
     glPixelStorei(GL_UNPACK_ALIGNMENT, 4);      // 4-byte pixel alignment
 
@@ -354,6 +660,9 @@ void initLights()
     float lightPos[4] = {0, 0, 1, 0}; // directional light
     glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
 
+    // the same light for the shader path, in eye space like GL_POSITION above
+    shader.setLight(glm::make_vec4(lightPos), glm::make_vec4(lightKa), glm::make_vec4(lightKd), glm::make_vec4(lightKs));
+
     glEnable(GL_LIGHT0);
 }
 
@@ -408,6 +717,26 @@ void showInfo()
     drawString(ss.str().c_str(), 1, screenHeight-(4*TEXT_HEIGHT), color, font);
     ss.str("");
 
+    ss << "  Water Level: " << params.W << (planet.isShaderClassified() ? " (classified per pixel)" : "") << ends;
+    drawString(ss.str().c_str(), 1, screenHeight - (8 * TEXT_HEIGHT), color, font);
+    ss.str("");
+
+    if (lod) {
+        ss << "   LOD Chunks: " << lod->getDrawnChunkCount() << " drawn, " << lod->getResidentChunkCount() << " resident ("
+           << lod->getResidentSize() / (1 << 20) << " MiB), level " << lod->getMaxLevel() << ends;
+        drawString(ss.str().c_str(), 1, screenHeight - (6 * TEXT_HEIGHT), color, font);
+        ss.str("");
+    }
+    else {
+        ss << "      Buffers: " << (planet.isUploaded() ? (planet.hasClientCopy() ? "GPU-resident" : "GPU only") : "client arrays") << ends;
+        drawString(ss.str().c_str(), 1, screenHeight - (6 * TEXT_HEIGHT), color, font);
+        ss.str("");
+    }
+
+    ss << "     Lighting: " << (useShaders ? "per pixel (GLSL 3.30)" : "fixed-function") << ends;
+    drawString(ss.str().c_str(), 1, screenHeight - (7 * TEXT_HEIGHT), color, font);
+    ss.str("");
+
     // unset floating format
     ss << resetiosflags(ios_base::fixed | ios_base::floatfield);
 
@@ -448,7 +777,7 @@ void toPerspective()
     // set perspective viewing frustum
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    gluPerspective(40.0f, (float)(screenWidth)/screenHeight, 1.0f, 1000.0f); // FOV, AspectRatio, NearClip, FarClip
+    gluPerspective(FOV_Y, (float)(screenWidth)/screenHeight, getNearClip(), 1000.0f); // FOV, AspectRatio, NearClip, FarClip
 
     // switch to modelview matrix in order to set scene
     glMatrixMode(GL_MODELVIEW);
@@ -523,6 +852,7 @@ void displayCB()
     glMaterialfv(GL_FRONT, GL_DIFFUSE,   diffuse);
     glMaterialfv(GL_FRONT, GL_SPECULAR,  specular);
     glMaterialf(GL_FRONT, GL_SHININESS, shininess);
+    shader.setMaterial(glm::make_vec4(specular), shininess);
 
     // line color
     float lineColor[] = {0.2f, 0.2f, 0.2f, 1};
@@ -532,7 +862,39 @@ void displayCB()
     glRotatef(cameraAngleX, 1, 0, 0);   // pitch
     glRotatef(cameraAngleY, 0, 1, 0);   // heading
     glRotatef(-90, 1, 0, 0);
-    planet.draw();
+
+    // the same transforms for the shader path and the LOD camera
+    glm::mat4 model = glm::rotate(glm::mat4(1.0f), glm::radians(cameraAngleX), glm::vec3(1, 0, 0));
+    model = glm::rotate(model, glm::radians(cameraAngleY), glm::vec3(0, 1, 0));
+    model = glm::rotate(model, glm::radians(-90.0f), glm::vec3(1, 0, 0));
+    if (useShaders) {
+        glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0, 0, -cameraDistance));
+        glm::mat4 projection = glm::perspective(glm::radians(FOV_Y), (float)screenWidth / screenHeight, getNearClip(), 1000.0f);
+        shader.setMatrices(view * model, projection);
+        shader.setClassification(planet.isShaderClassified());
+        if (planet.isShaderClassified()) {
+            TerrainUniforms terrain;        // all a water or temperature change costs
+            planet.getTerrainUniforms(terrain);
+            shader.setTerrain(terrain);
+        }
+        shader.begin();
+    }
+
+    if (lod) {
+        // the eye in planet space: undo the rotations above on (0, 0, cameraDistance)
+        glm::vec4 eye = glm::inverse(model) * glm::vec4(0, 0, cameraDistance, 1);
+
+        lod->update(glm::value_ptr(eye), FOV_Y, (float)screenWidth / screenHeight, screenHeight);
+        lod->draw();
+    }
+    else {
+        if (gpuBuffers)
+            planet.upload();    // no-op unless the planet was regenerated
+        planet.draw();
+    }
+
+    if (useShaders)
+        shader.end();
     glPopMatrix();
 
     showInfo();     // print max range of glDrawRangeElements
@@ -564,6 +926,42 @@ void keyboardCB(unsigned char key, int x, int y)
     case 27: // escape
         exit(0);
         break;
+
+    case 'b': // switch between buffer objects and client arrays
+    case 'B':
+        if (gpuBuffers)
+            planet.releaseBuffers();
+        gpuBuffers = !gpuBuffers && GLEW_VERSION_1_5;
+        break;
+
+    case 's': // switch between shader and fixed-function lighting
+    case 'S':
+        useShaders = !useShaders && shader.isReady();
+        if (params.shaderClassification) {
+            // the colours move between the vertices and the shader
+            planet.setParams(getPlanetParams());
+            resetLOD();
+        }
+        break;
+
+    case '[': // lower or raise the water level
+    case ']':
+        params.W = max(0.0f, min(1.0f, params.W + (key == '[' ? -0.01f : 0.01f)));
+        if (planet.setParams(getPlanetParams()) != STAGE_NONE)
+            resetLOD();
+        break;
+
+    case '-': // lower or raise the average temperature
+    case '=':
+        params.T += key == '-' ? -1.0f : 1.0f;
+        if (planet.setParams(getPlanetParams()) != STAGE_NONE)
+            resetLOD();
+        break;
+
+    case 'r': // reload the grammar, regenerating only what changed
+    case 'R':
+        parseFile(grammarFile, true);
+        break;
     }
 }
 
@@ -609,14 +1007,22 @@ void mouseMotionCB(int x, int y)
 {
     if(mouseLeftDown)
     {
-        cameraAngleY += (x - mouseX);
-        cameraAngleX += (y - mouseY);
+        // close to the surface a degree is a long way, so turn slower there
+        float speed = lod ? min(1.0f, max(cameraDistance - 1.0f, 0.001f)) : 1.0f;
+        cameraAngleY += (x - mouseX) * speed;
+        cameraAngleX += (y - mouseY) * speed;
         mouseX = x;
         mouseY = y;
     }
     if(mouseRightDown)
     {
-        cameraDistance -= (y - mouseY) * 0.2f;
+        if (lod) {
+            // zoom by a share of the altitude, so the surface can be approached smoothly
+            float altitude = max(cameraDistance - 1.0f, 0.0001f);
+            cameraDistance = 1.0f + max(altitude * powf(1.01f, (float)(mouseY - y)), 0.0001f);
+        }
+        else
+            cameraDistance -= (y - mouseY) * 0.2f;
         mouseY = y;
     }
 }